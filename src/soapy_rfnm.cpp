@@ -4,8 +4,44 @@
 #include <SoapySDR/Formats.hpp>
 
 #include "soapy_rfnm.h"
+#include "soapy_rfnm_multi.h"
 #include <librfnm/librfnm.h>
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <numbers>
+#include <sstream>
+
+#ifdef SOAPY_RFNM_HOTPLUG
+#include <libusb-1.0/libusb.h>
+#endif
+
+#ifdef __linux__
+#include <filesystem>
+#include <set>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+#endif
+
+// DC offsets are cached per LO band of this width
+#define SOAPY_RFNM_DC_CACHE_BAND_HZ 10000000
+#define SOAPY_RFNM_IQ_FILTER_COEFF 0.01f
+// without hotplug notifications enumeration results are reused for this long
+#define SOAPY_RFNM_FIND_CACHE_TTL std::chrono::seconds(1)
+// the AGC backs off at least this far when a read contained full scale samples
+#define SOAPY_RFNM_AGC_CLIP_STEP_DB 6.0f
+
 static uint16_t librfnm_rx_chan_flags[MAX_RX_CHAN_COUNT] = {
     LIBRFNM_CH0,
     LIBRFNM_CH1,
@@ -20,6 +56,53 @@ static uint16_t librfnm_rx_chan_apply[MAX_RX_CHAN_COUNT] = {
     LIBRFNM_APPLY_CH3_RX
 };
 
+#ifdef __linux__
+static std::set<pid_t> listThreads() {
+    std::set<pid_t> tids;
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator("/proc/self/task", ec)) {
+        tids.insert(std::stoi(entry.path().filename().string()));
+    }
+
+    return tids;
+}
+
+static std::string threadName(pid_t tid) {
+    std::ifstream comm("/proc/self/task/" + std::to_string(tid) + "/comm");
+    std::string name;
+    std::getline(comm, name);
+    return name;
+}
+
+// "0,2-3" style lists as used by taskset and cpusets
+static bool parseCpuList(const std::string& list, cpu_set_t& set) {
+    std::istringstream fields(list);
+    std::string field;
+
+    CPU_ZERO(&set);
+    while (std::getline(fields, field, ',')) {
+        size_t dash = field.find('-');
+        try {
+            int first = std::stoi(field.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(field.substr(dash + 1));
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, &set);
+            }
+        } catch (const std::logic_error&) {
+            return false;
+        }
+    }
+
+    return CPU_COUNT(&set) > 0;
+}
+#endif
+
+static long long nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 SoapyRFNM::SoapyRFNM(const SoapySDR::Kwargs& args) {
     spdlog::info("RFNMDevice::RFNMDevice()");
 
@@ -34,6 +117,16 @@ SoapyRFNM::SoapyRFNM(const SoapySDR::Kwargs& args) {
         throw std::runtime_error("Couldn't open the RFNM USB device handle");
     }
 
+    if (args.count("dc_cache") != 0) {
+        dc_cache_path = args.at("dc_cache");
+        loadDcCache();
+    }
+
+    // thread placement and transfer sizing given at open time apply to every stream that doesn't override them
+    parseThreadArgs(args, device_args);
+    parseTransferArgs(args, device_args);
+    session_args = device_args;
+
     rx_chan_count = lrfnm->s->hwinfo.daughterboard[0].rx_ch_cnt +
                     lrfnm->s->hwinfo.daughterboard[1].rx_ch_cnt;
 
@@ -43,7 +136,8 @@ SoapyRFNM::SoapyRFNM(const SoapySDR::Kwargs& args) {
         rx_chan_count = MAX_RX_CHAN_COUNT;
     }
 
-    // sane defaults
+    // Sane defaults. They only reach the hardware with the first apply, in the same transaction
+    // as the application's own first settings or the channel enables of setupStream.
     uint16_t apply_mask = 0;
     for (size_t i = 0; i < rx_chan_count; i++) {
         lrfnm->s->rx.ch[i].enable = RFNM_CH_OFF;
@@ -55,7 +149,7 @@ SoapyRFNM::SoapyRFNM(const SoapySDR::Kwargs& args) {
         lrfnm->s->rx.ch[i].rfic_lpf_bw = 80;
         apply_mask |= librfnm_rx_chan_apply[i];
     }
-    setRFNM(apply_mask);
+    pending_applies = apply_mask;
 
     //s->tx.ch[0].freq = RFNM_MHZ_TO_HZ(2450);
     //s->tx.ch[0].path = s->tx.ch[0].path_preferred;
@@ -65,13 +159,26 @@ SoapyRFNM::SoapyRFNM(const SoapySDR::Kwargs& args) {
 
 SoapyRFNM::~SoapyRFNM() {
     spdlog::info("RFNMDevice::~RFNMDevice()");
+    stopHopping();
+    stopAgc();
+    if (session_warm) {
+        // switch the ADCs off too, and send whatever is still pending with them
+        try {
+            stopSession();
+        } catch (const std::runtime_error& e) {
+            spdlog::error("failed to stop the receive session: {}", e.what());
+        }
+    }
+    stopApplying();
+    stopTimedCommands();
+    saveDcCache();
     delete lrfnm;
 
     for (size_t i = 0; i < rx_chan_count; i++) {
         free(partial_rx_buf[i].buf);
     }
 
-    for (int i = 0; i < SOAPY_RFNM_BUFCNT; i++) {
+    for (size_t i = 0; i < rx_bufs_alloced; i++) {
         free(rxbuf[i].buf);
     }
 }
@@ -92,7 +199,170 @@ SoapySDR::Kwargs SoapyRFNM::getHardwareInfo() const {
 }
 
 size_t SoapyRFNM::getStreamMTU(SoapySDR::Stream* stream) const {
-    return RFNM_USB_RX_PACKET_ELEM_CNT * 16;
+    if (sweep) {
+        return sweep->output.size();
+    }
+
+    auto* st = reinterpret_cast<struct rfnm_soapy_stream*>(stream);
+    size_t bytes_per_ele = lrfnm->s->transport_status.rx_stream_format;
+    if (!outbufsize || !bytes_per_ele) {
+        return RFNM_USB_RX_PACKET_ELEM_CNT * st->args.mtu_bufs;
+    }
+
+    return outbufsize / bytes_per_ele * st->args.mtu_bufs;
+}
+
+SoapySDR::ArgInfoList SoapyRFNM::getStreamArgsInfo(const int direction, const size_t channel) const {
+    SoapySDR::ArgInfoList args;
+
+    if (direction != SOAPY_SDR_RX) {
+        return args;
+    }
+
+    SoapySDR::ArgInfo warmup;
+    warmup.key = "async_warmup";
+    warmup.value = "false";
+    warmup.name = "Asynchronous Warm-up";
+    warmup.description = "Return from activateStream without waiting for the first buffer of each channel, "
+            "the initial DC calibration then runs on the first buffer readStream gets";
+    warmup.type = SoapySDR::ArgInfo::BOOL;
+    args.push_back(warmup);
+
+    SoapySDR::ArgInfo busy_poll;
+    busy_poll.key = "busy_poll_us";
+    busy_poll.value = "0";
+    busy_poll.name = "Busy Poll";
+    busy_poll.description = "Spin this long on each buffer in readStream before falling back to a blocking wait. "
+            "Trades one busy core for lower buffer-to-user latency, see the busy_poll_load sensor";
+    busy_poll.units = "us";
+    busy_poll.type = SoapySDR::ArgInfo::INT;
+    args.push_back(busy_poll);
+
+    SoapySDR::ArgInfo batch;
+    batch.key = "batch_latency_us";
+    batch.value = "0";
+    batch.name = "Batching Latency Cap";
+    batch.description = "Let readStream sleep until all buffers for numElems should have arrived and take them in one go, "
+            "returning a short read when that would hold samples back for longer than this. 0 wakes up for every buffer";
+    batch.units = "us";
+    batch.type = SoapySDR::ArgInfo::INT;
+    args.push_back(batch);
+
+    SoapySDR::ArgInfo profile;
+    profile.key = "profile";
+    profile.value = "custom";
+    profile.name = "Transfer Profile";
+    profile.description = "latency keeps the fewest buffers in flight and an MTU of one buffer, throughput keeps "
+            "twice as many in flight and a large MTU, custom only applies rx_buffers and mtu_buffers";
+    profile.type = SoapySDR::ArgInfo::STRING;
+    profile.options = { "latency", "throughput", "custom" };
+    profile.optionNames = { "Low Latency", "High Throughput", "Custom" };
+    args.push_back(profile);
+
+    SoapySDR::ArgInfo rx_buffers;
+    rx_buffers.key = "rx_buffers";
+    rx_buffers.value = std::to_string(SOAPY_RFNM_BUFCNT);
+    rx_buffers.name = "Buffers In Flight";
+    rx_buffers.description = "Receive buffers queued to librfnm, overrides the profile. "
+            "Takes effect when the next session starts and can only grow";
+    rx_buffers.type = SoapySDR::ArgInfo::INT;
+    rx_buffers.range = SoapySDR::Range(SOAPY_RFNM_BUFCNT, SOAPY_RFNM_MAX_BUFCNT);
+    args.push_back(rx_buffers);
+
+    SoapySDR::ArgInfo mtu_buffers;
+    mtu_buffers.key = "mtu_buffers";
+    mtu_buffers.value = std::to_string(SOAPY_RFNM_MTU_BUFS);
+    mtu_buffers.name = "MTU Buffers";
+    mtu_buffers.description = "Receive buffers per getStreamMTU, overrides the profile";
+    mtu_buffers.type = SoapySDR::ArgInfo::INT;
+    mtu_buffers.range = SoapySDR::Range(1, SOAPY_RFNM_MAX_BUFCNT);
+    args.push_back(mtu_buffers);
+
+    SoapySDR::ArgInfo rx_cpus;
+    rx_cpus.key = "rx_cpus";
+    rx_cpus.name = "Receive Thread CPUs";
+    rx_cpus.description = "CPUs the librfnm receive threads may run on, e.g. 2,3 or 2-5 (Linux only)";
+    rx_cpus.type = SoapySDR::ArgInfo::STRING;
+    args.push_back(rx_cpus);
+
+    SoapySDR::ArgInfo rx_priority;
+    rx_priority.key = "rx_priority";
+    rx_priority.value = "0";
+    rx_priority.name = "Receive Thread Priority";
+    rx_priority.description = "SCHED_FIFO priority of the librfnm receive threads, 0 keeps the default scheduler. "
+            "Needs CAP_SYS_NICE or a matching RLIMIT_RTPRIO (Linux only)";
+    rx_priority.type = SoapySDR::ArgInfo::INT;
+    rx_priority.range = SoapySDR::Range(0, 99);
+    args.push_back(rx_priority);
+
+    SoapySDR::ArgInfo read_cpus;
+    read_cpus.key = "read_cpus";
+    read_cpus.name = "Reader CPUs";
+    read_cpus.description = "CPUs the thread calling readStream is pinned to on its first read (Linux only)";
+    read_cpus.type = SoapySDR::ArgInfo::STRING;
+    args.push_back(read_cpus);
+
+    SoapySDR::ArgInfo numa_node;
+    numa_node.key = "numa_node";
+    numa_node.value = "-1";
+    numa_node.name = "Buffer NUMA Node";
+    numa_node.description = "NUMA node the receive buffers are placed on, -1 leaves placement to the kernel. "
+            "Only takes effect when the buffers are first allocated (Linux only)";
+    numa_node.type = SoapySDR::ArgInfo::INT;
+    args.push_back(numa_node);
+
+    SoapySDR::ArgInfo start;
+    start.key = "sweep_start";
+    start.name = "Sweep Start";
+    start.description = "Lowest frequency of a sweep stream; setting this turns the stream into a sweep "
+            "that returns F32 power spectra in dB instead of IQ samples";
+    start.units = "Hz";
+    start.type = SoapySDR::ArgInfo::FLOAT;
+    args.push_back(start);
+
+    SoapySDR::ArgInfo stop;
+    stop.key = "sweep_stop";
+    stop.name = "Sweep Stop";
+    stop.description = "Highest frequency of a sweep stream";
+    stop.units = "Hz";
+    stop.type = SoapySDR::ArgInfo::FLOAT;
+    args.push_back(stop);
+
+    SoapySDR::ArgInfo fft_size;
+    fft_size.key = "sweep_fft_size";
+    fft_size.value = "1024";
+    fft_size.name = "Sweep FFT Size";
+    fft_size.description = "FFT length of each sweep step, must be a power of two";
+    fft_size.type = SoapySDR::ArgInfo::INT;
+    args.push_back(fft_size);
+
+    SoapySDR::ArgInfo averages;
+    averages.key = "sweep_averages";
+    averages.value = "8";
+    averages.name = "Sweep Averages";
+    averages.description = "Number of FFTs averaged per sweep step";
+    averages.type = SoapySDR::ArgInfo::INT;
+    args.push_back(averages);
+
+    SoapySDR::ArgInfo settle;
+    settle.key = "sweep_settle_us";
+    settle.value = "100";
+    settle.name = "Sweep Settling Time";
+    settle.description = "Samples discarded after each retune, on top of the first buffer after the retune";
+    settle.units = "us";
+    settle.type = SoapySDR::ArgInfo::INT;
+    args.push_back(settle);
+
+    SoapySDR::ArgInfo usable;
+    usable.key = "sweep_usable";
+    usable.value = "0.75";
+    usable.name = "Sweep Usable Bandwidth";
+    usable.description = "Fraction of the sample rate kept from each step; the band edges are dropped";
+    usable.type = SoapySDR::ArgInfo::FLOAT;
+    usable.range = SoapySDR::Range(0.05, 1.0);
+    args.push_back(usable);
+
+    return args;
 }
 
 size_t SoapyRFNM::getNumChannels(const int direction) const {
@@ -123,7 +393,7 @@ double SoapyRFNM::getSampleRate(const int direction, const size_t channel) const
             throw std::runtime_error("nonexistent channel");
         }
 
-        return lrfnm->s->hwinfo.clock.dcs_clk / lrfnm->s->rx.ch[channel].samp_freq_div_n;
+        return lrfnm->s->hwinfo.clock.dcs_clk / stagedChannel(channel).samp_freq_div_n;
     } else {
         return 0;
     }
@@ -135,14 +405,16 @@ void SoapyRFNM::setSampleRate(const int direction, const size_t channel, const d
             throw std::runtime_error("nonexistent channel");
         }
 
+        int div_n;
         if (rate == lrfnm->s->hwinfo.clock.dcs_clk) {
-            lrfnm->s->rx.ch[channel].samp_freq_div_n = 1;
+            div_n = 1;
         } else if (rate == lrfnm->s->hwinfo.clock.dcs_clk / 2) {
-            lrfnm->s->rx.ch[channel].samp_freq_div_n = 2;
+            div_n = 2;
         } else {
             throw std::runtime_error("unsupported sample rate");
         }
-        setRFNM(librfnm_rx_chan_apply[channel]);
+        // setRFNM restarts the clock once the new divider reaches the hardware
+        configure(channel, [div_n](struct rfnm_api_rx_ch& ch) { ch.samp_freq_div_n = div_n; });
     }
 }
 
@@ -191,424 +463,2632 @@ static void applyQuadDcOffset(T *buf, size_t n, const T *offsets) {
     }
 }
 
-int SoapyRFNM::activateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs,
-        const size_t numElems) {
-    spdlog::info("RFNMDevice::activateStream()");
-
-    for (size_t channel = 0; channel < MAX_RX_CHAN_COUNT; channel++) {
-        if (lrfnm->s->rx.ch[channel].enable != RFNM_CH_ON) {
-            continue;
-        }
-
-        // First sample can sometimes take a while to come, so fetch it here before normal streaming
-        // This first chunk is also useful for initial calibration
-        struct librfnm_rx_buf* lrxbuf;
-        if (lrfnm->rx_dqbuf(&lrxbuf, librfnm_rx_chan_flags[channel], 250)) {
-            throw std::runtime_error("timeout activating stream");
+template <class T>
+static void updateQuadDcEstimate(const float *accum, size_t n, T *offsets, float *estimate, float filter_coeff) {
+    // the estimate is kept in float so integer offsets still move by less than 1 LSB per buffer
+    float f = 8.0f / n;
+    for (size_t j = 0; j < 8; j++) {
+        estimate[j] = accum[j] * f * filter_coeff + estimate[j] * (1.0f - filter_coeff);
+        if constexpr (std::is_integral_v<T>) {
+            offsets[j] = static_cast<T>(std::lround(estimate[j]));
+        } else {
+            offsets[j] = estimate[j];
         }
+    }
+}
 
-        std::memcpy(partial_rx_buf[channel].buf, lrxbuf->buf, outbufsize);
-        partial_rx_buf[channel].left = outbufsize;
-        partial_rx_buf[channel].offset = 0;
-        lrfnm->rx_qbuf(lrxbuf);
+// Single pass correction that also folds the buffer into a running estimate of the offsets
+template <class T>
+static void applyTrackQuadDcOffset(T *buf, size_t n, T *offsets, float *estimate, float filter_coeff) {
+    assert((n & 0x7) == 0);
 
-        // Compute initial DC offsets
-        switch (lrfnm->s->transport_status.rx_stream_format) {
-        case LIBRFNM_STREAM_FORMAT_CS8:
-            measQuadDcOffset(reinterpret_cast<int8_t *>(partial_rx_buf[channel].buf),
-                    outbufsize, dc_offsets[channel].i8, 1.0f);
-            break;
-        case LIBRFNM_STREAM_FORMAT_CS16:
-            measQuadDcOffset(reinterpret_cast<int16_t *>(partial_rx_buf[channel].buf),
-                    outbufsize / 2, dc_offsets[channel].i16, 1.0f);
-            break;
-        case LIBRFNM_STREAM_FORMAT_CF32:
-            measQuadDcOffset(reinterpret_cast<float *>(partial_rx_buf[channel].buf),
-                    outbufsize / 4, dc_offsets[channel].f32, 1.0f);
-            break;
-        }
+    float accum[8] = {};
 
-        // Apply DC correction on first chunk if requested
-        if (dc_correction[channel]) {
-            switch (lrfnm->s->transport_status.rx_stream_format) {
-            case LIBRFNM_STREAM_FORMAT_CS8:
-                applyQuadDcOffset(reinterpret_cast<int8_t *>(partial_rx_buf[channel].buf),
-                        outbufsize, dc_offsets[channel].i8);
-                break;
-            case LIBRFNM_STREAM_FORMAT_CS16:
-                applyQuadDcOffset(reinterpret_cast<int16_t *>(partial_rx_buf[channel].buf),
-                        outbufsize / 2, dc_offsets[channel].i16);
-                break;
-            case LIBRFNM_STREAM_FORMAT_CF32:
-                applyQuadDcOffset(reinterpret_cast<float *>(partial_rx_buf[channel].buf),
-                        outbufsize / 4, dc_offsets[channel].f32);
-                break;
-            }
+    for (size_t i = 0; i < n; i += 8) {
+        #pragma GCC unroll 8
+        for (size_t j = 0; j < 8; j++) {
+            accum[j] += buf[i+j];
+            buf[i+j] -= offsets[j];
         }
     }
 
-    return 0;
-}
-
-int SoapyRFNM::deactivateStream(SoapySDR::Stream* stream, const int flags0, const long long int timeNs) {
-    spdlog::info("RFNMDevice::deactivateStream()");
-
-    return 0;
+    updateQuadDcEstimate(accum, n, offsets, estimate, filter_coeff);
 }
 
-std::vector<std::string> SoapyRFNM::listFrequencies(const int direction, const size_t channel) const {
-    std::vector<std::string> names;
-    names.push_back("RF");
-    return names;
+template <class T>
+static T toSample(float v) {
+    if constexpr (std::is_integral_v<T>) {
+        // round half away from zero and saturate without branches, so the kernel vectorises
+        int32_t r = static_cast<int32_t>(v + std::copysign(0.5f, v));
+        return static_cast<T>(std::clamp<int32_t>(r, std::numeric_limits<T>::min(), std::numeric_limits<T>::max()));
+    } else {
+        return v;
+    }
 }
 
-SoapySDR::RangeList SoapyRFNM::getFrequencyRange(const int direction, const size_t channel, const std::string &name) const {
-    SoapySDR::RangeList results;
+// DC removal fused with IQ balance correction. Q is rebuilt as c_q * Q + c_i * I, while the raw
+// sums and the second order moments of the DC corrected input are gathered for the next buffer.
+// Blocks of 16 I/Q pairs with per-lane sums let GCC vectorise the pair loop at -O2.
+template <class T>
+static void applyQuadDcIqBalance(T *buf, size_t n, const T *offsets, float *accum, float *moments,
+        float c_i, float c_q) {
+    assert((n & 0x7) == 0);
 
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
-        }
+    constexpr size_t pairs = 16;
+    float off[2 * pairs];
+    float sum[2 * pairs] = {};
+    float ii[pairs] = {};
+    float qq[pairs] = {};
+    float iq[pairs] = {};
 
-        results.push_back(SoapySDR::Range(
-                    lrfnm->s->rx.ch[channel].freq_min,
-                    lrfnm->s->rx.ch[channel].freq_max));
+    for (size_t k = 0; k < 2 * pairs; k++) {
+        off[k] = offsets[k & 7];
     }
 
-    return results;
-}
-
-double SoapyRFNM::getFrequency(const int direction, const size_t channel, const std::string &name) const {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
+    auto correct = [&](T *block, size_t k) {
+        float i_raw = block[2*k];
+        float q_raw = block[2*k+1];
+        sum[2*k] += i_raw;
+        sum[2*k+1] += q_raw;
+
+        float x = i_raw - off[2*k];
+        float y = q_raw - off[2*k+1];
+        ii[k] += x * x;
+        qq[k] += y * y;
+        iq[k] += x * y;
+
+        block[2*k] = toSample<T>(x);
+        block[2*k+1] = toSample<T>(y * c_q + x * c_i);
+    };
+
+    size_t i = 0;
+    for (; i + 2 * pairs <= n; i += 2 * pairs) {
+        // fully unrolled, the pair loop is no longer vectorised
+        #pragma GCC unroll 1
+        for (size_t k = 0; k < pairs; k++) {
+            correct(buf + i, k);
         }
+    }
 
-        return lrfnm->s->rx.ch[channel].freq;
-    } else {
-        return 0;
+    // blocks start on a multiple of 8, so the lanes still line up with the offsets
+    for (size_t k = 0; i + 2 * k < n; k++) {
+        correct(buf + i, k);
     }
-}
 
-void SoapyRFNM::setFrequency(const int direction, const size_t channel, const std::string &name,
-        const double frequency, const SoapySDR::Kwargs& args) {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
-        }
+    for (size_t k = 0; k < 2 * pairs; k++) {
+        accum[k & 7] += sum[k];
+    }
 
-        lrfnm->s->rx.ch[channel].freq = frequency;
-        setRFNM(librfnm_rx_chan_apply[channel]);
+    moments[0] = moments[1] = moments[2] = 0.0f;
+    for (size_t k = 0; k < pairs; k++) {
+        moments[0] += ii[k];
+        moments[1] += qq[k];
+        moments[2] += iq[k];
     }
 }
 
-std::vector<std::string> SoapyRFNM::listGains(const int direction, const size_t channel) const {
-    std::vector<std::string> names;
-    names.push_back("RF");
-    return names;
+template <class T>
+static constexpr float fullScale() {
+    if constexpr (std::is_integral_v<T>) {
+        return std::numeric_limits<T>::max();
+    } else {
+        return 1.0f;
+    }
 }
 
-double SoapyRFNM::getGain(const int direction, const size_t channel, const std::string &name) const {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
-        }
-
-        return lrfnm->s->rx.ch[channel].gain;
+// |v| in an integer type that sorts like the magnitude: the widened integer, or the float bits
+// with the sign cleared, which order the same way as non-negative floats do
+template <class T>
+static auto magnitude(T v) {
+    if constexpr (std::is_integral_v<T>) {
+        int32_t x = v;
+        return x < 0 ? -x : x;
     } else {
-        return 0;
+        uint32_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        return bits & 0x7fffffffu;
     }
 }
 
-void SoapyRFNM::setGain(const int direction, const size_t channel, const std::string &name, const double value) {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
+// Copy I/Q values out and gather their power, peak and full scale counts on the way, or only gather
+// them without copy. Per-lane sums and an integer peak keep the loop free of float reductions, and
+// with the buffers declared apart GCC needs no alias check, so it vectorises at -O2 as well.
+template <class T, bool copy = true>
+static void copyQuadStats(T *__restrict dst, const T *__restrict src, size_t n, struct rfnm_soapy_rx_stats &stats) {
+    using M = decltype(magnitude(T()));
+    constexpr size_t lanes = 16;
+    const M full = magnitude(static_cast<T>(fullScale<T>()));
+    float power[lanes] = {};
+    M peak[lanes] = {};
+    M clipped[lanes] = {};
+    size_t i = 0;
+
+    for (; i + lanes <= n; i += lanes) {
+        // fully unrolled, the lane loop is no longer vectorised
+        #pragma GCC unroll 1
+        for (size_t j = 0; j < lanes; j++) {
+            T s = src[i+j];
+            if constexpr (copy) {
+                dst[i+j] = s;
+            }
+            float v = s;
+            M a = magnitude(s);
+            power[j] += v * v;
+            peak[j] = std::max(peak[j], a);
+            clipped[j] += a >= full;
         }
-
-        lrfnm->s->rx.ch[channel].gain = value;
-        setRFNM(librfnm_rx_chan_apply[channel]);
     }
-}
 
-SoapySDR::Range SoapyRFNM::getGainRange(const int direction, const size_t channel, const std::string &name) const {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
+    for (; i < n; i++) {
+        T s = src[i];
+        if constexpr (copy) {
+            dst[i] = s;
         }
-
-        return SoapySDR::Range(
-                lrfnm->s->rx.ch[channel].gain_range.min,
-                lrfnm->s->rx.ch[channel].gain_range.max);
-    } else {
-        return SoapySDR::Range(0, 0);
+        float v = s;
+        M a = magnitude(s);
+        power[0] += v * v;
+        peak[0] = std::max(peak[0], a);
+        clipped[0] += a >= full;
     }
-}
 
-double SoapyRFNM::getBandwidth(const int direction, const size_t channel) const {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
-        }
+    double sum = 0.0;
+    M top = 0;
+    for (size_t j = 0; j < lanes; j++) {
+        sum += power[j];
+        top = std::max(top, peak[j]);
+        stats.clipped += clipped[j];
+    }
 
-        return lrfnm->s->rx.ch[channel].rfic_lpf_bw * 1e6;
+    float top_value;
+    if constexpr (std::is_integral_v<T>) {
+        top_value = top;
     } else {
-        return 0;
+        std::memcpy(&top_value, &top, sizeof(top_value));
     }
-}
 
-void SoapyRFNM::setBandwidth(const int direction, const size_t channel, const double bw) {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
-        }
+    constexpr float full_scale = fullScale<T>();
+    stats.power += sum / (full_scale * full_scale);
+    stats.peak = std::max(stats.peak, top_value / full_scale);
+    stats.values += n;
+}
 
-        if (bw == 0.0) return; // special ignore value
+static struct rfnm_soapy_rx_stats quadStats(const uint8_t *buf, size_t elems, int format) {
+    struct rfnm_soapy_rx_stats stats;
 
-        lrfnm->s->rx.ch[channel].rfic_lpf_bw = bw / 1e6;
-        setRFNM(librfnm_rx_chan_apply[channel]);
+    switch (format) {
+    case LIBRFNM_STREAM_FORMAT_CS8:
+        copyQuadStats<int8_t, false>(nullptr, reinterpret_cast<const int8_t *>(buf), 2 * elems, stats);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CS16:
+        copyQuadStats<int16_t, false>(nullptr, reinterpret_cast<const int16_t *>(buf), 2 * elems, stats);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CF32:
+        copyQuadStats<float, false>(nullptr, reinterpret_cast<const float *>(buf), 2 * elems, stats);
+        break;
     }
-}
 
-SoapySDR::RangeList SoapyRFNM::getBandwidthRange(const int direction, const size_t channel) const {
-    SoapySDR::RangeList bws;
-    bws.push_back(SoapySDR::Range(1e6, 100e6));
-    return bws;
+    return stats;
 }
 
-std::vector<std::string> SoapyRFNM::listAntennas(const int direction, const size_t channel) const {
-    std::vector<std::string> ants;
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
+static void fftRadix2(std::complex<float> *x, size_t n, const std::complex<float> *twiddles) {
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
         }
+        j ^= bit;
+        if (i < j) {
+            std::swap(x[i], x[j]);
+        }
+    }
 
-        for (int a = 0; a < 10; a++) {
-            if (lrfnm->s->rx.ch[channel].path_possible[a] == RFNM_PATH_NULL) {
-                break;
+    for (size_t len = 2; len <= n; len <<= 1) {
+        size_t tw_step = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t j = 0; j < len / 2; j++) {
+                std::complex<float> u = x[i+j];
+                std::complex<float> v = x[i+j+len/2] * twiddles[j * tw_step];
+                x[i+j] = u + v;
+                x[i+j+len/2] = u - v;
             }
-            ants.push_back(librfnm::rf_path_to_string(lrfnm->s->rx.ch[channel].path_possible[a]));
         }
     }
-    else if (direction == SOAPY_SDR_TX) {
-        //   ants.push_back("TXH");
-        //    ants.push_back("TXW");
-    }
-    return ants;
 }
 
-std::string SoapyRFNM::getAntenna(const int direction, const size_t channel) const {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
-        }
+// Averaged power spectrum of the captured step, keeping only the center bins_per_step bins
+static void sweepPowerSpectrum(struct rfnm_soapy_sweep &sw, bool remove_dc, float *out) {
+    size_t n = sw.fft_size;
+    std::complex<float> mean = {};
 
-        return librfnm::rf_path_to_string(lrfnm->s->rx.ch[channel].path);
-    } else {
-        return "";
+    if (remove_dc) {
+        for (auto &c : sw.capture) {
+            mean += c;
+        }
+        mean /= static_cast<float>(sw.capture.size());
     }
-}
 
-void SoapyRFNM::setAntenna(const int direction, const size_t channel, const std::string& name) {
-    if (direction == SOAPY_SDR_RX) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
+    std::fill(sw.psd.begin(), sw.psd.end(), 0.0f);
+    for (size_t a = 0; a < sw.averages; a++) {
+        const std::complex<float> *seg = sw.capture.data() + a * n;
+        for (size_t i = 0; i < n; i++) {
+            sw.fft_buf[i] = (seg[i] - mean) * sw.window[i];
         }
+        fftRadix2(sw.fft_buf.data(), n, sw.twiddles.data());
+        for (size_t i = 0; i < n; i++) {
+            sw.psd[i] += std::norm(sw.fft_buf[i]);
+        }
+    }
 
-        lrfnm->s->rx.ch[channel].path = librfnm::string_to_rf_path(name);
-        setRFNM(librfnm_rx_chan_apply[channel]);
+    float scale = 1.0f / (sw.averages * sw.window_power);
+    size_t first = n / 2 - sw.bins_per_step / 2;
+    for (size_t b = 0; b < sw.bins_per_step; b++) {
+        // fftshift: shifted bin i lives at raw index (i + n/2) % n
+        float p = sw.psd[(first + b + n / 2) % n] * scale;
+        out[b] = 10.0f * std::log10(p + 1e-20f);
     }
 }
 
-SoapySDR::Stream* SoapyRFNM::setupStream(const int direction, const std::string& format,
-        const std::vector<size_t>& channels, const SoapySDR::Kwargs& args) {
-    if (direction != SOAPY_SDR_RX) {
-        return nullptr;
+int SoapyRFNM::activateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs,
+        const size_t numElems) {
+    spdlog::info("RFNMDevice::activateStream()");
+    auto* st = reinterpret_cast<struct rfnm_soapy_stream*>(stream);
+    std::lock_guard<std::mutex> stream_lock(stream_mutex);
+
+    if (stream_paused) {
+        // restart the receive threads on the buffers kept from before the pause
+        startRxThreads(stream_format);
+        lrfnm->rx_flush(0);
+        stream_paused = false;
     }
 
-    if (stream_setup) {
-        throw std::runtime_error("multiple streams unsupported");
-    }
+    // channels put on standby through stream_enable stay off
+    std::vector<size_t> channels;
+    std::copy_if(st->channels.begin(), st->channels.end(), std::back_inserter(channels),
+            [this](size_t channel) { return !channel_standby[channel]; });
 
-    // bounds check channels before we start the stream
-    for (size_t channel : channels) {
-        if (channel >= rx_chan_count) {
-            throw std::runtime_error("nonexistent channel");
+    // channels stay off while their stream is inactive, so they don't tie up the shared buffers
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        uint16_t apply_mask = 0;
+        for (size_t channel : channels) {
+            if (lrfnm->s->rx.ch[channel].enable != RFNM_CH_ON) {
+                lrfnm->s->rx.ch[channel].enable = RFNM_CH_ON;
+                apply_mask |= librfnm_rx_chan_apply[channel];
+            }
+        }
+        if (apply_mask) {
+            apply_mask |= pending_applies;
+            pending_applies = 0;
+            setRFNM(apply_mask);
         }
     }
 
-    enum librfnm_stream_format stream_format;
-    bool alloc_buffers = true;
-
-    if (!format.compare(SOAPY_SDR_CF32)) {
-        stream_format = LIBRFNM_STREAM_FORMAT_CF32;
-    } else if (!format.compare(SOAPY_SDR_CS16)) {
-        stream_format = LIBRFNM_STREAM_FORMAT_CS16;
-    } else if (!format.compare(SOAPY_SDR_CS8)) {
-        stream_format = LIBRFNM_STREAM_FORMAT_CS8;
-    } else {
-        throw std::runtime_error("setupStream invalid format " + format);
+    if (sweep) {
+        // the sweep resynchronises itself on the first step, no warm-up buffer needed
+        sweep->captured = 0;
+        sweep->settle_left = sweep->settle_elems;
+        st->active = true;
+        return 0;
     }
 
-    if (lrfnm->s->transport_status.rx_stream_format) {
-        if (stream_format != lrfnm->s->transport_status.rx_stream_format) {
-            throw std::runtime_error("changing stream format is unsupported");
+    // warm up all channels at once, the first buffer can take a while on each of them
+    std::vector<std::future<void>> warmups;
+    for (size_t channel : channels) {
+        if (restart_ns[channel]) {
+            // the clock kept running through a fast restart, drop what was captured before it
+            std::lock_guard<std::mutex> lock(rx_event_mutex);
+            rx_events[channel].clear();
+            rx_discard_until[channel] = sampleAtTime(channel, restart_ns[channel]);
+            restart_ns[channel] = 0;
+        } else {
+            resetClock(channel);
+            std::lock_guard<std::mutex> lock(rx_event_mutex);
+            rx_events[channel].clear();
+            rx_discard_until[channel] = 0;
         }
-        alloc_buffers = false;
-    }
-
-    lrfnm->rx_stream(stream_format, &outbufsize);
 
-    if (alloc_buffers) {
-        for (int i = 0; i < SOAPY_RFNM_BUFCNT; i++) {
-            rxbuf[i].buf = (uint8_t*)malloc(outbufsize);
-            lrfnm->rx_qbuf(&rxbuf[i]);
-            //txbuf[i].buf = rxbuf[i].buf;
-            //txbuf[i].buf = (uint8_t*)malloc(inbufsize);
-        }
+        // start from the cached offsets for these settings if there are any
+        seedDcOffset(channel, lrfnm->s->rx.ch[channel]);
+        takeDcSeed(channel);
 
-        for (size_t channel = 0; channel < rx_chan_count; channel++) {
-            partial_rx_buf[channel].buf = (uint8_t*)malloc(outbufsize);
+        if (st->async_warmup) {
+            // readStream calibrates on the first buffer it gets instead
+            partial_rx_buf[channel].left = 0;
+        } else {
+            warmups.push_back(std::async(std::launch::async, &SoapyRFNM::warmUpChannel, this, channel));
         }
     }
 
-    // flush old junk before streaming new data
-    lrfnm->rx_flush(20);
+    for (auto& warmup : warmups) {
+        warmup.get();
+    }
 
-    uint16_t apply_mask = 0;
+    // finite acquisition of numElems per channel, optionally starting at timeNs
     for (size_t channel : channels) {
-        lrfnm->s->rx.ch[channel].enable = RFNM_CH_ON;
-        apply_mask |= librfnm_rx_chan_apply[channel];
+        burst_active[channel] = (flags & SOAPY_SDR_END_BURST) && numElems;
+        burst_left[channel] = numElems;
+        burst_start_ns[channel] = timeNs;
+        burst_start_pending[channel] = false;
+
+        if (!burst_active[channel] || !(flags & SOAPY_SDR_HAS_TIME)) {
+            continue;
+        }
+
+        if (st->async_warmup) {
+            // no buffer seen yet to place timeNs in the stream, readStream resolves it
+            burst_start_pending[channel] = true;
+        } else {
+            std::lock_guard<std::mutex> lock(rx_event_mutex);
+            rx_discard_until[channel] = std::max(rx_discard_until[channel], sampleAtTime(channel, timeNs));
+        }
     }
-    setRFNM(apply_mask);
 
-    stream_setup = true;
+    st->active = true;
+    stream_active = true;
+    startHopping();
 
-    return (SoapySDR::Stream*)this;
+    return 0;
 }
 
-void SoapyRFNM::closeStream(SoapySDR::Stream* stream) {
-    spdlog::info("RFNMDevice::closeStream() -> Closing stream");
-
-    // stop the receiver threads
-    lrfnm->rx_stream_stop();
+void SoapyRFNM::parseThreadArgs(const SoapySDR::Kwargs& args, struct rfnm_soapy_stream_args& out) {
+    if (args.count("rx_cpus") != 0) {
+        out.rx_cpus = args.at("rx_cpus");
+    }
+    if (args.count("rx_priority") != 0) {
+        int priority = std::stoi(args.at("rx_priority"));
+        if (priority < 0 || priority > 99) {
+            throw std::runtime_error("rx_priority must be between 0 and 99");
+        }
+        out.rx_priority = priority;
+    }
+    if (args.count("read_cpus") != 0) {
+        out.read_cpus = args.at("read_cpus");
+    }
+    if (args.count("numa_node") != 0) {
+        out.numa_node = std::stoi(args.at("numa_node"));
+    }
+}
+
+void SoapyRFNM::parseTransferArgs(const SoapySDR::Kwargs& args, struct rfnm_soapy_stream_args& out) {
+    if (args.count("profile") != 0) {
+        const std::string& profile = args.at("profile");
+        if (profile == "latency") {
+            out.rx_bufcnt = SOAPY_RFNM_BUFCNT;
+            out.mtu_bufs = 1;
+        } else if (profile == "throughput") {
+            out.rx_bufcnt = 2 * SOAPY_RFNM_BUFCNT;
+            out.mtu_bufs = 4 * SOAPY_RFNM_MTU_BUFS;
+        } else if (profile != "custom") {
+            throw std::runtime_error("invalid profile " + profile);
+        }
+    }
+    if (args.count("rx_buffers") != 0) {
+        long count = std::stol(args.at("rx_buffers"));
+        if (count < SOAPY_RFNM_BUFCNT || count > SOAPY_RFNM_MAX_BUFCNT) {
+            throw std::runtime_error("rx_buffers must be between " + std::to_string(SOAPY_RFNM_BUFCNT) +
+                    " and " + std::to_string(SOAPY_RFNM_MAX_BUFCNT));
+        }
+        out.rx_bufcnt = count;
+    }
+    if (args.count("mtu_buffers") != 0) {
+        long count = std::stol(args.at("mtu_buffers"));
+        if (count < 1 || count > SOAPY_RFNM_MAX_BUFCNT) {
+            throw std::runtime_error("mtu_buffers must be between 1 and " + std::to_string(SOAPY_RFNM_MAX_BUFCNT));
+        }
+        out.mtu_bufs = count;
+    }
+}
+
+void SoapyRFNM::startRxThreads(enum librfnm_stream_format format) {
+#ifdef __linux__
+    // librfnm doesn't hand out its threads. A new thread takes the name of the one that started it, so the
+    // receive threads are the ones rx_stream adds under a name this thread carries for that call only.
+    // Threads other units or the application start meanwhile keep their own names.
+    static std::atomic<unsigned> tag_seq = 0;
+    std::string tag = "rfnm-rx-" + std::to_string(tag_seq++ % 10000000);
+    char name[16] = {};
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    pthread_setname_np(pthread_self(), tag.c_str());
+
+    std::set<pid_t> before = listThreads();
+    try {
+        lrfnm->rx_stream(format, &outbufsize);
+    } catch (...) {
+        pthread_setname_np(pthread_self(), name);
+        throw;
+    }
+    std::set<pid_t> after = listThreads();
+    pthread_setname_np(pthread_self(), name);
+
+    rx_tids.clear();
+    for (pid_t tid : after) {
+        if (!before.count(tid) && threadName(tid) == tag) {
+            rx_tids.push_back(tid);
+        }
+    }
+    if (rx_tids.empty() && (!session_args.rx_cpus.empty() || session_args.rx_priority)) {
+        spdlog::warn("no librfnm receive threads found, rx_cpus and rx_priority are not applied");
+    }
+#else
+    lrfnm->rx_stream(format, &outbufsize);
+#endif
+
+    placeRxThreads();
+}
+
+void SoapyRFNM::placeRxThreads() {
+    if (session_args.rx_cpus.empty() && !session_args.rx_priority) {
+        return;
+    }
+
+#ifdef __linux__
+    cpu_set_t cpus;
+    bool pin = !session_args.rx_cpus.empty() && parseCpuList(session_args.rx_cpus, cpus);
+    if (!session_args.rx_cpus.empty() && !pin) {
+        spdlog::warn("ignoring invalid rx_cpus list {}", session_args.rx_cpus);
+    }
+
+    for (pid_t tid : rx_tids) {
+        if (pin && sched_setaffinity(tid, sizeof(cpus), &cpus)) {
+            spdlog::warn("failed to pin receive thread {}: {}", tid, std::strerror(errno));
+        }
+
+        if (session_args.rx_priority) {
+            struct sched_param param = {};
+            param.sched_priority = session_args.rx_priority;
+            if (sched_setscheduler(tid, SCHED_FIFO, &param)) {
+                spdlog::warn("failed to make receive thread {} SCHED_FIFO: {}", tid, std::strerror(errno));
+            }
+        }
+    }
+#else
+    spdlog::warn("rx_cpus and rx_priority are only supported on Linux");
+#endif
+}
+
+void SoapyRFNM::pinReader(const struct rfnm_soapy_stream& st) {
+    if (st.args.read_cpus.empty()) {
+        return;
+    }
+
+#ifdef __linux__
+    cpu_set_t cpus;
+    if (!parseCpuList(st.args.read_cpus, cpus)) {
+        spdlog::warn("ignoring invalid read_cpus list {}", st.args.read_cpus);
+        return;
+    }
+
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret) {
+        spdlog::warn("failed to pin the readStream thread: {}", std::strerror(ret));
+    }
+#else
+    spdlog::warn("read_cpus is only supported on Linux");
+#endif
+}
+
+uint8_t* SoapyRFNM::allocBuffer(size_t size) {
+    int node = session_args.numa_node;
+    if (node < 0) {
+        return (uint8_t*)malloc(size);
+    }
+
+#ifdef __linux__
+    // whole pages, so the policy covers the buffer and nothing that shares its pages
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + page - 1) / page * page;
+    uint8_t* buf = (uint8_t*)aligned_alloc(page, len);
+    if (!buf) {
+        throw std::bad_alloc();
+    }
+
+    unsigned long nodemask[4] = {};
+    constexpr size_t nodemask_bits = sizeof(nodemask) * 8;
+    if (static_cast<size_t>(node) >= nodemask_bits) {
+        spdlog::warn("numa_node {} out of range", node);
+        return buf;
+    }
+    nodemask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+
+    if (syscall(SYS_mbind, buf, len, MPOL_PREFERRED, nodemask, nodemask_bits, MPOL_MF_MOVE)) {
+        spdlog::warn("failed to place receive buffer on NUMA node {}: {}", node, std::strerror(errno));
+    }
+
+    return buf;
+#else
+    spdlog::warn("numa_node is only supported on Linux");
+    return (uint8_t*)malloc(size);
+#endif
+}
+
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+int SoapyRFNM::dequeue(size_t channel, struct librfnm_rx_buf** lrxbuf, int64_t wait_us) {
+    uint32_t wait_ms = wait_us / 1000;
+    long long spin_ns = std::min<long long>(busy_poll[channel].count(), wait_us) * 1000;
+
+    if (spin_ns <= 0) {
+        return lrfnm->rx_dqbuf(lrxbuf, librfnm_rx_chan_flags[channel], wait_ms);
+    }
+
+    // spin on the queue first, a sleeping reader adds the wake-up latency to every buffer
+    long long start_ns = nowNs();
+    long long elapsed_ns = 0;
+    while (true) {
+        if (!lrfnm->rx_dqbuf(lrxbuf, librfnm_rx_chan_flags[channel], 0)) {
+            poll_spin_ns[channel] += nowNs() - start_ns;
+            poll_hits[channel]++;
+            return 0;
+        }
+
+        elapsed_ns = nowNs() - start_ns;
+        if (elapsed_ns >= spin_ns) {
+            break;
+        }
+        cpuRelax();
+    }
+    poll_spin_ns[channel] += elapsed_ns;
+
+    // then block for whatever is left of the timeout
+    uint32_t spent_ms = elapsed_ns / 1000000;
+    return lrfnm->rx_dqbuf(lrxbuf, librfnm_rx_chan_flags[channel], wait_ms > spent_ms ? wait_ms - spent_ms : 0);
+}
+
+void SoapyRFNM::warmUpChannel(size_t channel) {
+    // First sample can sometimes take a while to come, so fetch it here before normal streaming
+    // This first chunk is also useful for initial calibration
+    struct librfnm_rx_buf* lrxbuf;
+    if (lrfnm->rx_dqbuf(&lrxbuf, librfnm_rx_chan_flags[channel], 250)) {
+        throw std::runtime_error("timeout activating stream");
+    }
+
+    std::memcpy(partial_rx_buf[channel].buf, lrxbuf->buf, outbufsize);
+    partial_rx_buf[channel].left = outbufsize;
+    partial_rx_buf[channel].offset = 0;
+    partial_rx_buf[channel].sample = observeClock(channel, lrxbuf->usb_cc);
+    lrfnm->rx_qbuf(lrxbuf);
+
+    // Compute initial DC offsets, unless they came from the cache
+    if (dc_init_pending[channel]) {
+        measDcOffset(channel, partial_rx_buf[channel].buf, 1.0f);
+        dc_init_pending[channel] = false;
+    }
+
+    // Apply DC and IQ balance correction on first chunk if requested
+    if (iq_correction[channel]) {
+        applyDcIqBalance(channel, partial_rx_buf[channel].buf, 0.0f);
+    } else if (dc_correction[channel]) {
+        applyDcOffset(channel, partial_rx_buf[channel].buf);
+    }
+}
+
+void SoapyRFNM::syncDcEstimate(size_t channel) {
+    float* estimate = dc_estimate[channel];
+
+    if (!dc_estimate_valid[channel]) {
+        for (size_t j = 0; j < 8; j++) {
+            switch (lrfnm->s->transport_status.rx_stream_format) {
+            case LIBRFNM_STREAM_FORMAT_CS8:
+                estimate[j] = dc_offsets[channel].i8[j];
+                break;
+            case LIBRFNM_STREAM_FORMAT_CS16:
+                estimate[j] = dc_offsets[channel].i16[j];
+                break;
+            case LIBRFNM_STREAM_FORMAT_CF32:
+                estimate[j] = dc_offsets[channel].f32[j];
+                break;
+            }
+        }
+        dc_estimate_valid[channel] = true;
+    }
+}
+
+void SoapyRFNM::trackDcOffset(size_t channel, uint8_t* buf, float filter_coeff) {
+    float* estimate = dc_estimate[channel];
+    dc_updates[channel]++;
+    syncDcEstimate(channel);
+
+    switch (lrfnm->s->transport_status.rx_stream_format) {
+    case LIBRFNM_STREAM_FORMAT_CS8:
+        applyTrackQuadDcOffset(reinterpret_cast<int8_t *>(buf), outbufsize, dc_offsets[channel].i8, estimate, filter_coeff);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CS16:
+        applyTrackQuadDcOffset(reinterpret_cast<int16_t *>(buf), outbufsize / 2, dc_offsets[channel].i16, estimate, filter_coeff);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CF32:
+        applyTrackQuadDcOffset(reinterpret_cast<float *>(buf), outbufsize / 4, dc_offsets[channel].f32, estimate, filter_coeff);
+        break;
+    }
+}
+
+void SoapyRFNM::measDcOffset(size_t channel, uint8_t* buf, float filter_coeff) {
+    dc_updates[channel]++;
+    dc_estimate_valid[channel] = false;
+
+    switch (lrfnm->s->transport_status.rx_stream_format) {
+    case LIBRFNM_STREAM_FORMAT_CS8:
+        measQuadDcOffset(reinterpret_cast<int8_t *>(buf), outbufsize, dc_offsets[channel].i8, filter_coeff);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CS16:
+        measQuadDcOffset(reinterpret_cast<int16_t *>(buf), outbufsize / 2, dc_offsets[channel].i16, filter_coeff);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CF32:
+        measQuadDcOffset(reinterpret_cast<float *>(buf), outbufsize / 4, dc_offsets[channel].f32, filter_coeff);
+        break;
+    }
+}
+
+static struct rfnm_soapy_dc_key dcKey(const struct rfnm_api_rx_ch& ch, enum librfnm_stream_format format) {
+    struct rfnm_soapy_dc_key key;
+    key.band = ch.freq / SOAPY_RFNM_DC_CACHE_BAND_HZ;
+    key.gain = ch.gain;
+    key.path = ch.path;
+    key.div_n = ch.samp_freq_div_n;
+    key.format = format;
+    return key;
+}
+
+void SoapyRFNM::seedDcOffset(size_t channel, const struct rfnm_api_rx_ch& ch) {
+    std::lock_guard<std::mutex> lock(dc_mutex);
+    struct rfnm_soapy_dc_key key = dcKey(ch, lrfnm->s->transport_status.rx_stream_format);
+
+    if (key != dc_key[channel]) {
+        dc_seed_key[channel] = key;
+        dc_seed_pending[channel] = true;
+    }
+}
+
+void SoapyRFNM::takeDcSeed(size_t channel) {
+    std::lock_guard<std::mutex> lock(dc_mutex);
+
+    if (!dc_seed_pending[channel]) {
+        return;
+    }
+
+    // an estimate that has been tracked past its initial measurement is worth keeping
+    if (dc_updates[channel] >= 2) {
+        dc_cache[dc_key[channel]] = dc_offsets[channel];
+    }
+
+    // IQ imbalance follows the LO, start over once it moved to another band
+    if (dc_key[channel].band != dc_seed_key[channel].band) {
+        iq_balance[channel] = {};
+    }
+
+    dc_key[channel] = dc_seed_key[channel];
+    dc_estimate_valid[channel] = false;
+    auto it = dc_cache.find(dc_key[channel]);
+    if (it != dc_cache.end()) {
+        dc_offsets[channel] = it->second;
+        dc_updates[channel] = 2;
+        dc_init_pending[channel] = false;
+    } else {
+        dc_updates[channel] = 0;
+        dc_init_pending[channel] = true;
+    }
+
+    dc_seed_pending[channel] = false;
+}
+
+void SoapyRFNM::loadDcCache() {
+    std::ifstream file(dc_cache_path);
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        struct rfnm_soapy_dc_key key;
+        int64_t band;
+        int gain, path, div_n, format;
+        double v[8];
+
+        if (!(fields >> band >> gain >> path >> div_n >> format)) {
+            continue;
+        }
+        for (auto& x : v) {
+            fields >> x;
+        }
+        if (!fields) {
+            continue;
+        }
+
+        key.band = band;
+        key.gain = gain;
+        key.path = static_cast<enum rfnm_rf_path>(path);
+        key.div_n = div_n;
+        key.format = static_cast<enum librfnm_stream_format>(format);
+
+        union rfnm_quad_dc_offset offsets = {};
+        for (size_t j = 0; j < 8; j++) {
+            switch (key.format) {
+            case LIBRFNM_STREAM_FORMAT_CS8:
+                offsets.i8[j] = v[j];
+                break;
+            case LIBRFNM_STREAM_FORMAT_CS16:
+                offsets.i16[j] = v[j];
+                break;
+            case LIBRFNM_STREAM_FORMAT_CF32:
+                offsets.f32[j] = v[j];
+                break;
+            }
+        }
+        dc_cache[key] = offsets;
+    }
+
+    spdlog::info("loaded {} DC offset cache entries from {}", dc_cache.size(), dc_cache_path);
+}
+
+void SoapyRFNM::saveDcCache() {
+    if (dc_cache_path.empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(dc_mutex);
+
+    // include what the channels are tracking right now
+    for (size_t channel = 0; channel < rx_chan_count; channel++) {
+        if (dc_updates[channel] >= 2) {
+            dc_cache[dc_key[channel]] = dc_offsets[channel];
+        }
+    }
+
+    std::ofstream file(dc_cache_path, std::ios::trunc);
+    if (!file) {
+        spdlog::warn("can't write DC offset cache {}", dc_cache_path);
+        return;
+    }
+
+    for (auto& [key, offsets] : dc_cache) {
+        file << key.band << " " << static_cast<int>(key.gain) << " " << static_cast<int>(key.path) << " "
+             << static_cast<int>(key.div_n) << " " << static_cast<int>(key.format);
+        for (size_t j = 0; j < 8; j++) {
+            switch (key.format) {
+            case LIBRFNM_STREAM_FORMAT_CS8:
+                file << " " << static_cast<int>(offsets.i8[j]);
+                break;
+            case LIBRFNM_STREAM_FORMAT_CS16:
+                file << " " << offsets.i16[j];
+                break;
+            case LIBRFNM_STREAM_FORMAT_CF32:
+                file << " " << offsets.f32[j];
+                break;
+            }
+        }
+        file << "\n";
+    }
+}
+
+void SoapyRFNM::applyDcIqBalance(size_t channel, uint8_t* buf, float dc_track_coeff) {
+    static const union rfnm_quad_dc_offset no_offsets = {};
+    const union rfnm_quad_dc_offset& offsets = dc_correction[channel] ? dc_offsets[channel] : no_offsets;
+    struct rfnm_soapy_iq_balance& iqb = iq_balance[channel];
+    float accum[8] = {};
+    float moments[3];
+    size_t n = 0;
+
+    switch (lrfnm->s->transport_status.rx_stream_format) {
+    case LIBRFNM_STREAM_FORMAT_CS8:
+        n = outbufsize;
+        applyQuadDcIqBalance(reinterpret_cast<int8_t *>(buf), n, offsets.i8, accum, moments, iqb.c_i, iqb.c_q);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CS16:
+        n = outbufsize / 2;
+        applyQuadDcIqBalance(reinterpret_cast<int16_t *>(buf), n, offsets.i16, accum, moments, iqb.c_i, iqb.c_q);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CF32:
+        n = outbufsize / 4;
+        applyQuadDcIqBalance(reinterpret_cast<float *>(buf), n, offsets.f32, accum, moments, iqb.c_i, iqb.c_q);
+        break;
+    }
+
+    if (dc_track_coeff > 0.0f) {
+        dc_updates[channel]++;
+        syncDcEstimate(channel);
+        switch (lrfnm->s->transport_status.rx_stream_format) {
+        case LIBRFNM_STREAM_FORMAT_CS8:
+            updateQuadDcEstimate(accum, n, dc_offsets[channel].i8, dc_estimate[channel], dc_track_coeff);
+            break;
+        case LIBRFNM_STREAM_FORMAT_CS16:
+            updateQuadDcEstimate(accum, n, dc_offsets[channel].i16, dc_estimate[channel], dc_track_coeff);
+            break;
+        case LIBRFNM_STREAM_FORMAT_CF32:
+            updateQuadDcEstimate(accum, n, dc_offsets[channel].f32, dc_estimate[channel], dc_track_coeff);
+            break;
+        }
+    }
+
+    // blind estimate: decorrelate Q from I, then scale it to the power of I
+    float f = 2.0f / n;
+    float coeff = iqb.valid ? SOAPY_RFNM_IQ_FILTER_COEFF : 1.0f;
+    iqb.ii = moments[0] * f * coeff + iqb.ii * (1.0f - coeff);
+    iqb.qq = moments[1] * f * coeff + iqb.qq * (1.0f - coeff);
+    iqb.iq = moments[2] * f * coeff + iqb.iq * (1.0f - coeff);
+    iqb.valid = true;
+
+    if (iqb.ii > 0.0f) {
+        float rho = iqb.iq / iqb.ii;
+        float q_power = iqb.qq - rho * iqb.iq;
+        if (q_power > 0.0f) {
+            iqb.c_q = std::sqrt(iqb.ii / q_power);
+            iqb.c_i = -rho * iqb.c_q;
+        }
+    }
+}
+
+void SoapyRFNM::applyDcOffset(size_t channel, uint8_t* buf) {
+    switch (lrfnm->s->transport_status.rx_stream_format) {
+    case LIBRFNM_STREAM_FORMAT_CS8:
+        applyQuadDcOffset(reinterpret_cast<int8_t *>(buf), outbufsize, dc_offsets[channel].i8);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CS16:
+        applyQuadDcOffset(reinterpret_cast<int16_t *>(buf), outbufsize / 2, dc_offsets[channel].i16);
+        break;
+    case LIBRFNM_STREAM_FORMAT_CF32:
+        applyQuadDcOffset(reinterpret_cast<float *>(buf), outbufsize / 4, dc_offsets[channel].f32);
+        break;
+    }
+}
+
+int SoapyRFNM::deactivateStream(SoapySDR::Stream* stream, const int flags0, const long long int timeNs) {
+    spdlog::info("RFNMDevice::deactivateStream()");
+    auto* st = reinterpret_cast<struct rfnm_soapy_stream*>(stream);
+    std::lock_guard<std::mutex> stream_lock(stream_mutex);
+
+    endStream(*st);
+
+    return 0;
+}
+
+void SoapyRFNM::endStream(struct rfnm_soapy_stream& st) {
+    // callers hold stream_mutex
+    st.active = false;
+    for (size_t channel : st.channels) {
+        burst_active[channel] = false;
+    }
+
+    bool others_active = std::any_of(streams.begin(), streams.end(),
+            [](const std::unique_ptr<struct rfnm_soapy_stream>& other) { return other->active; });
+
+    if (others_active) {
+        stopChannels(st.channels);
+        return;
+    }
+
+    stopHopping();
+    stream_active = false;
+    pauseStream();
+}
+
+void SoapyRFNM::stopChannels(const std::vector<size_t>& channels) {
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        uint16_t apply_mask = 0;
+        for (size_t channel : channels) {
+            if (lrfnm->s->rx.ch[channel].enable != RFNM_CH_OFF) {
+                lrfnm->s->rx.ch[channel].enable = RFNM_CH_OFF;
+                apply_mask |= librfnm_rx_chan_apply[channel];
+            }
+        }
+        if (apply_mask) {
+            setRFNM(apply_mask);
+        }
+    }
+
+    // hand back what the channels still had queued, the other streams share these buffers
+    for (size_t channel : channels) {
+        struct librfnm_rx_buf* lrxbuf;
+        while (!lrfnm->rx_dqbuf(&lrxbuf, librfnm_rx_chan_flags[channel], 0)) {
+            lrfnm->rx_qbuf(lrxbuf);
+        }
+    }
+}
+
+void SoapyRFNM::startChannel(size_t channel) {
+    // readStream skips the channel until this is done, so its state can be reset here
+    resetClock(channel);
+    {
+        std::lock_guard<std::mutex> lock(rx_event_mutex);
+        rx_events[channel].clear();
+        rx_discard_until[channel] = 0;
+    }
+    partial_rx_buf[channel].left = 0;
+    burst_active[channel] = false;
+
+    // DC offsets come from the cache or the first buffer readStream gets, like an async warm-up
+    std::lock_guard<std::mutex> lock(config_mutex);
+    lrfnm->s->rx.ch[channel].enable = RFNM_CH_ON;
+    setRFNM(librfnm_rx_chan_apply[channel]);
+}
+
+void SoapyRFNM::pauseStream() {
+    if (stream_paused) {
+        return;
+    }
+
+    // stop the ADCs and the USB transfers, the buffers stay allocated for a quick resume
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        uint16_t apply_mask = 0;
+        for (size_t channel = 0; channel < rx_chan_count; channel++) {
+            if (stream_channels[channel]) {
+                lrfnm->s->rx.ch[channel].enable = RFNM_CH_OFF;
+                apply_mask |= librfnm_rx_chan_apply[channel];
+            }
+        }
+        setRFNM(apply_mask);
+    }
+
+    lrfnm->rx_stream_stop();
+    rx_tids.clear();
+
+    // nothing captured before the pause may come out after the resume
+    lrfnm->rx_flush(0);
+    for (size_t channel = 0; channel < rx_chan_count; channel++) {
+        partial_rx_buf[channel].left = 0;
+    }
+
+    stream_paused = true;
+}
+
+std::vector<std::string> SoapyRFNM::listFrequencies(const int direction, const size_t channel) const {
+    std::vector<std::string> names;
+    names.push_back("RF");
+    return names;
+}
+
+SoapySDR::RangeList SoapyRFNM::getFrequencyRange(const int direction, const size_t channel, const std::string &name) const {
+    SoapySDR::RangeList results;
+
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        results.push_back(SoapySDR::Range(
+                    lrfnm->s->rx.ch[channel].freq_min,
+                    lrfnm->s->rx.ch[channel].freq_max));
+    }
+
+    return results;
+}
+
+double SoapyRFNM::getFrequency(const int direction, const size_t channel, const std::string &name) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        return stagedChannel(channel).freq;
+    } else {
+        return 0;
+    }
+}
+
+void SoapyRFNM::setFrequency(const int direction, const size_t channel, const std::string &name,
+        const double frequency, const SoapySDR::Kwargs& args) {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        configure(channel, [frequency](struct rfnm_api_rx_ch& ch) { ch.freq = frequency; });
+    }
+}
+
+std::vector<std::string> SoapyRFNM::listGains(const int direction, const size_t channel) const {
+    std::vector<std::string> names;
+    names.push_back("RF");
+    return names;
+}
+
+double SoapyRFNM::getGain(const int direction, const size_t channel, const std::string &name) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        return stagedChannel(channel).gain;
+    } else {
+        return 0;
+    }
+}
+
+void SoapyRFNM::setGain(const int direction, const size_t channel, const std::string &name, const double value) {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        configure(channel, [value](struct rfnm_api_rx_ch& ch) { ch.gain = value; });
+    }
+}
+
+SoapySDR::Range SoapyRFNM::getGainRange(const int direction, const size_t channel, const std::string &name) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        return SoapySDR::Range(
+                lrfnm->s->rx.ch[channel].gain_range.min,
+                lrfnm->s->rx.ch[channel].gain_range.max);
+    } else {
+        return SoapySDR::Range(0, 0);
+    }
+}
+
+double SoapyRFNM::getBandwidth(const int direction, const size_t channel) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        return stagedChannel(channel).rfic_lpf_bw * 1e6;
+    } else {
+        return 0;
+    }
+}
+
+void SoapyRFNM::setBandwidth(const int direction, const size_t channel, const double bw) {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        if (bw == 0.0) return; // special ignore value
+
+        configure(channel, [bw](struct rfnm_api_rx_ch& ch) { ch.rfic_lpf_bw = bw / 1e6; });
+    }
+}
+
+SoapySDR::RangeList SoapyRFNM::getBandwidthRange(const int direction, const size_t channel) const {
+    SoapySDR::RangeList bws;
+    bws.push_back(SoapySDR::Range(1e6, 100e6));
+    return bws;
+}
+
+std::vector<std::string> SoapyRFNM::listAntennas(const int direction, const size_t channel) const {
+    std::vector<std::string> ants;
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        for (int a = 0; a < 10; a++) {
+            if (lrfnm->s->rx.ch[channel].path_possible[a] == RFNM_PATH_NULL) {
+                break;
+            }
+            ants.push_back(librfnm::rf_path_to_string(lrfnm->s->rx.ch[channel].path_possible[a]));
+        }
+    }
+    else if (direction == SOAPY_SDR_TX) {
+        //   ants.push_back("TXH");
+        //    ants.push_back("TXW");
+    }
+    return ants;
+}
+
+std::string SoapyRFNM::getAntenna(const int direction, const size_t channel) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        return librfnm::rf_path_to_string(stagedChannel(channel).path);
+    } else {
+        return "";
+    }
+}
+
+void SoapyRFNM::setAntenna(const int direction, const size_t channel, const std::string& name) {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+
+        enum rfnm_rf_path path = librfnm::string_to_rf_path(name);
+        configure(channel, [path](struct rfnm_api_rx_ch& ch) { ch.path = path; });
+    }
+}
+
+SoapySDR::Stream* SoapyRFNM::setupStream(const int direction, const std::string& format,
+        const std::vector<size_t>& channels, const SoapySDR::Kwargs& args) {
+    if (direction != SOAPY_SDR_RX) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> stream_lock(stream_mutex);
+    bool first = streams.empty();
+
+    if (sweep) {
+        throw std::runtime_error("multiple streams unsupported while sweeping");
+    }
+
+    if (args.count("sweep_start") != 0 && !first) {
+        throw std::runtime_error("sweep streams need the device to themselves");
+    }
+
+    // bounds check channels before we start the stream
+    bool requested[MAX_RX_CHAN_COUNT] = {};
+    for (size_t channel : channels) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
+        if (stream_channels[channel] || requested[channel]) {
+            throw std::runtime_error("channel already streaming");
+        }
+        requested[channel] = true;
+    }
+
+    enum librfnm_stream_format stream_format;
+    bool alloc_buffers = true;
+
+    if (args.count("sweep_start") != 0) {
+        // sweeps run their FFTs on CF32 and hand out F32 power spectra
+        if (format.compare(SOAPY_SDR_F32)) {
+            throw std::runtime_error("sweep streams only support " SOAPY_SDR_F32);
+        }
+        stream_format = LIBRFNM_STREAM_FORMAT_CF32;
+    } else if (!format.compare(SOAPY_SDR_CF32)) {
+        stream_format = LIBRFNM_STREAM_FORMAT_CF32;
+    } else if (!format.compare(SOAPY_SDR_CS16)) {
+        stream_format = LIBRFNM_STREAM_FORMAT_CS16;
+    } else if (!format.compare(SOAPY_SDR_CS8)) {
+        stream_format = LIBRFNM_STREAM_FORMAT_CS8;
+    } else {
+        throw std::runtime_error("setupStream invalid format " + format);
+    }
+
+    if (lrfnm->s->transport_status.rx_stream_format) {
+        if (stream_format != lrfnm->s->transport_status.rx_stream_format) {
+            throw std::runtime_error("changing stream format is unsupported");
+        }
+        alloc_buffers = false;
+    }
+
+    // everything that can reject the stream is checked before the session is touched
+    struct rfnm_soapy_stream_args stream_args = device_args;
+    parseThreadArgs(args, stream_args);
+    parseTransferArgs(args, stream_args);
+
+    std::chrono::microseconds busy_poll_us(args.count("busy_poll_us") != 0 ? std::stol(args.at("busy_poll_us")) : 0);
+    std::chrono::microseconds batch_latency_us(
+            args.count("batch_latency_us") != 0 ? std::stol(args.at("batch_latency_us")) : 0);
+
+    std::unique_ptr<struct rfnm_soapy_sweep> sw;
+    if (args.count("sweep_start") != 0) {
+        if (channels.size() != 1) {
+            throw std::runtime_error("sweep streams need exactly one channel");
+        }
+        sw = setupSweep(channels[0], args);
+    }
+
+    // a session kept warm by fast_restart is reused when the format still matches
+    bool warm = false;
+    if (first && session_warm) {
+        if (stream_format == this->stream_format && args.count("sweep_start") == 0) {
+            warm = true;
+        } else {
+            stopSession();
+        }
+    }
+
+    // later streams join the librfnm session the first one started
+    if (first && !warm) {
+        session_args = stream_args;
+        startRxThreads(stream_format);
+
+        if (alloc_buffers) {
+            for (size_t channel = 0; channel < rx_chan_count; channel++) {
+                partial_rx_buf[channel].buf = allocBuffer(outbufsize);
+                partial_rx_buf[channel].size = outbufsize;
+            }
+        }
+
+        // buffers librfnm already holds stay with it, a larger in-flight count only adds to them
+        for (size_t i = rx_bufs_alloced; i < stream_args.rx_bufcnt; i++) {
+            rxbuf[i].buf = allocBuffer(outbufsize);
+            lrfnm->rx_qbuf(&rxbuf[i]);
+            //txbuf[i].buf = rxbuf[i].buf;
+            //txbuf[i].buf = (uint8_t*)malloc(inbufsize);
+        }
+        if (stream_args.rx_bufcnt < rx_bufs_alloced) {
+            spdlog::warn("keeping {} receive buffers in flight, the count can't shrink once allocated", rx_bufs_alloced);
+        }
+        rx_bufs_alloced = std::max(rx_bufs_alloced, stream_args.rx_bufcnt);
+
+        // flush old junk before streaming new data
+        lrfnm->rx_flush(20);
+    } else if (args.count("rx_cpus") != 0 || args.count("rx_priority") != 0) {
+        // the receive threads are shared by the session, move the running ones
+        session_args.rx_cpus = stream_args.rx_cpus;
+        session_args.rx_priority = stream_args.rx_priority;
+        placeRxThreads();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        for (size_t channel : channels) {
+            rx_stats[channel] = {};
+            rx_clipped[channel] = 0;
+        }
+    }
+
+    for (size_t channel : channels) {
+        batch_latency[channel] = batch_latency_us;
+        busy_poll[channel] = busy_poll_us;
+        poll_spin_ns[channel] = 0;
+        poll_hits[channel] = 0;
+        poll_since_ns[channel] = nowNs();
+    }
+
+    if (warm) {
+        long long restart_ns = nowNs();
+
+        std::vector<size_t> unused;
+        for (size_t channel = 0; channel < rx_chan_count; channel++) {
+            if (warm_channels[channel] && !requested[channel]) {
+                unused.push_back(channel);
+            }
+        }
+        stopChannels(unused);
+
+        // What is queued was captured before the restart. Buffers still in flight are dropped
+        // by readStream, which places restart_ns in the stream through their usb_cc.
+        for (size_t channel : channels) {
+            if (!warm_channels[channel]) {
+                continue;
+            }
+            struct librfnm_rx_buf* lrxbuf;
+            while (!lrfnm->rx_dqbuf(&lrxbuf, librfnm_rx_chan_flags[channel], 0)) {
+                lrfnm->rx_qbuf(lrxbuf);
+            }
+            this->restart_ns[channel] = restart_ns;
+        }
+
+        session_warm = false;
+    }
+
+    auto st = std::make_unique<struct rfnm_soapy_stream>();
+    st->channels = channels;
+    st->async_warmup = args.count("async_warmup") != 0 && args.at("async_warmup") == "true";
+    st->args = stream_args;
+
+    if (sw) {
+        // the first buffer after a retune may already have been in flight, always drop it
+        sw->settle_elems += outbufsize / LIBRFNM_STREAM_FORMAT_CF32;
+        sw->settle_left = sw->settle_elems;
+    }
+
+    std::lock_guard<std::mutex> lock(config_mutex);
+
+    // starting a stream commits any deferred changes along with the channel enables,
+    // later streams switch their channels on in activateStream
+    mergeDeferred();
+    if (sw) {
+        // park the LO on the first step so the stream starts tuned
+        lrfnm->s->rx.ch[channels[0]].freq = sw->centers[0];
+        sweep = std::move(sw);
+    }
+    uint16_t apply_mask = pending_applies;
+    for (size_t channel : channels) {
+        if (first && !(warm && warm_channels[channel])) {
+            lrfnm->s->rx.ch[channel].enable = RFNM_CH_ON;
+            apply_mask |= librfnm_rx_chan_apply[channel];
+        }
+        stream_channels[channel] = true;
+    }
+    pending_applies = 0;
+    setRFNM(apply_mask);
+
+    this->stream_format = stream_format;
+    streams.push_back(std::move(st));
+
+    return reinterpret_cast<SoapySDR::Stream*>(streams.back().get());
+}
+
+void SoapyRFNM::closeStream(SoapySDR::Stream* stream) {
+    spdlog::info("RFNMDevice::closeStream() -> Closing stream");
+    auto* st = reinterpret_cast<struct rfnm_soapy_stream*>(stream);
+    std::lock_guard<std::mutex> stream_lock(stream_mutex);
+
+    auto it = std::find_if(streams.begin(), streams.end(),
+            [st](const std::unique_ptr<struct rfnm_soapy_stream>& other) { return other.get() == st; });
+    if (it == streams.end()) {
+        return;
+    }
+
+    // the other streams keep the librfnm session running
+    if (streams.size() > 1) {
+        if (st->active) {
+            endStream(*st);
+        }
+        stopChannels(st->channels);
+        for (size_t channel : st->channels) {
+            stream_channels[channel] = false;
+            channel_standby[channel] = false;
+        }
+        streams.erase(it);
+        return;
+    }
+
+    stopHopping();
+    stream_active = false;
+
+    // leave the receive threads and the channels running, the next setupStream picks them up
+    if (fast_restart && !sweep && !stream_paused) {
+        for (size_t channel = 0; channel < rx_chan_count; channel++) {
+            warm_channels[channel] = lrfnm->s->rx.ch[channel].enable == RFNM_CH_ON;
+        }
+        session_warm = true;
+    } else {
+        stopSession();
+    }
+
+    sweep.reset();
+    std::fill(std::begin(stream_channels), std::end(stream_channels), false);
+    for (auto& standby : channel_standby) {
+        standby = false;
+    }
+
+    saveDcCache();
+    streams.clear();
+}
+
+void SoapyRFNM::stopSession() {
+    // stop the receiver threads, unless a pause already did
+    if (!stream_paused) {
+        lrfnm->rx_stream_stop();
+    }
+    rx_tids.clear();
+    stream_paused = false;
+    session_warm = false;
+
+    // stop the ADCs
+    std::unique_lock<std::mutex> lock(config_mutex);
+    uint16_t apply_mask = pending_applies;
+    for (size_t i = 0; i < rx_chan_count; i++) {
+        if (lrfnm->s->rx.ch[i].enable != RFNM_CH_OFF) {
+            lrfnm->s->rx.ch[i].enable = RFNM_CH_OFF;
+            apply_mask |= librfnm_rx_chan_apply[i];
+        }
+    }
+    pending_applies = 0;
+    setRFNM(apply_mask);
+    lock.unlock();
+
+    // flush buffers
+    lrfnm->rx_flush(0);
+}
+
+int SoapyRFNM::readStreamStatus(SoapySDR::Stream* stream, size_t& chanMask, int& flags, long long& timeNs,
+        const long timeoutUs) {
+    std::unique_lock<std::mutex> lock(status_mutex);
+
+    if (!status_cv.wait_for(lock, std::chrono::microseconds(timeoutUs), [this] { return !status_events.empty(); })) {
+        return SOAPY_SDR_TIMEOUT;
+    }
+
+    struct rfnm_soapy_status_event ev = status_events.front();
+    status_events.pop_front();
+
+    chanMask = ev.chan_mask;
+    flags = ev.flags;
+    timeNs = ev.timeNs;
+    return ev.ret;
+}
+
+int SoapyRFNM::readStream(SoapySDR::Stream* stream, void* const* buffs, const size_t numElems, int& flags,
+        long long int& timeNs, const long timeoutUs) {
+    flags = 0;
+    if (sweep) {
+        return readSweep(buffs, numElems, flags, timeoutUs);
+    }
+
+    auto* st = reinterpret_cast<struct rfnm_soapy_stream*>(stream);
+    auto timeout = std::chrono::system_clock::now() + std::chrono::microseconds(timeoutUs);
+    size_t read_elems = 0;
+
+    if (st->reader != std::this_thread::get_id()) {
+        st->reader = std::this_thread::get_id();
+        pinReader(*st);
+    }
+
+    // TODO: keep usb_cc of each channel in sync
+
+    // buffers of channels on standby are left untouched
+    size_t counts[MAX_RX_CHAN_COUNT] = {};
+    int chan_flags[MAX_RX_CHAN_COUNT] = {};
+    long long chan_times[MAX_RX_CHAN_COUNT] = {};
+    struct rfnm_soapy_rx_stats chan_stats[MAX_RX_CHAN_COUNT];
+    bool any = false;
+    for (size_t i = 0; i < st->channels.size(); i++) {
+        if (channel_standby[st->channels[i]]) {
+            continue;
+        }
+
+        counts[i] = readChannel(st->channels[i], reinterpret_cast<uint8_t*>(buffs[i]), numElems, chan_flags[i],
+                chan_times[i], chan_stats[i], timeout, timeoutUs);
+        if (!any && (chan_flags[i] & SOAPY_SDR_HAS_TIME)) {
+            flags |= SOAPY_SDR_HAS_TIME;
+            timeNs = chan_times[i];
+        }
+        read_elems = any ? std::min(read_elems, counts[i]) : counts[i];
+        any = true;
+    }
+
+    // A boundary, a timeout or a finished burst on one channel shortens the whole read. The other
+    // channels keep what they read past it for the next call, so they stay in step.
+    size_t bytes_per_ele = lrfnm->s->transport_status.rx_stream_format;
+    for (size_t i = 0; i < st->channels.size(); i++) {
+        if (channel_standby[st->channels[i]]) {
+            continue;
+        }
+
+        if (counts[i] > read_elems) {
+            unreadChannel(st->channels[i], reinterpret_cast<uint8_t*>(buffs[i]) + bytes_per_ele * read_elems,
+                    counts[i] - read_elems);
+            // the levels only cover what is returned, the next read counts the tail
+            chan_stats[i] = quadStats(reinterpret_cast<uint8_t*>(buffs[i]), read_elems, bytes_per_ele);
+        } else {
+            flags |= chan_flags[i] & SOAPY_SDR_END_BURST;
+        }
+        publishStats(st->channels[i], chan_stats[i], chan_times[i]);
+    }
+
+    bool burst = false;
+    bool done = true;
+    for (size_t channel : st->channels) {
+        if (channel_standby[channel]) {
+            continue;
+        }
+        burst |= burst_active[channel];
+        if (burst_left[channel]) {
+            done = false;
+        }
+    }
+
+    // every channel has its samples, stop the hardware until the next activateStream
+    if (burst && done) {
+        std::lock_guard<std::mutex> stream_lock(stream_mutex);
+        endStream(*st);
+    }
+
+    return read_elems;
+}
+
+void SoapyRFNM::unreadChannel(size_t channel, const uint8_t* src, size_t elems) {
+    // src holds the samples readChannel handed out last, right before what partial still has.
+    // They are already corrected, so the next read copies them out as they are.
+    struct rfnm_soapy_partial_buf& partial = partial_rx_buf[channel];
+    size_t bytes_per_ele = lrfnm->s->transport_status.rx_stream_format;
+    size_t bytes = bytes_per_ele * elems;
+
+    if (partial.offset < bytes) {
+        if (bytes + partial.left > partial.size) {
+            uint8_t* buf = allocBuffer(bytes + partial.left);
+            std::memcpy(buf + bytes, partial.buf + partial.offset, partial.left);
+            free(partial.buf);
+            partial.buf = buf;
+            partial.size = bytes + partial.left;
+        } else {
+            std::memmove(partial.buf + bytes, partial.buf + partial.offset, partial.left);
+        }
+        partial.offset = bytes;
+    }
+
+    partial.offset -= bytes;
+    partial.left += bytes;
+    partial.sample -= elems;
+    std::memcpy(partial.buf + partial.offset, src, bytes);
+
+    if (burst_active[channel]) {
+        burst_left[channel] += elems;
+    }
+}
+
+size_t SoapyRFNM::readChannel(size_t channel, uint8_t* dst, const size_t numElems, int& flags, long long& timeNs,
+        struct rfnm_soapy_rx_stats& stats, std::chrono::system_clock::time_point timeout, const long timeoutUs) {
+    size_t bytes_per_ele = lrfnm->s->transport_status.rx_stream_format;
+    size_t elems_per_buf = outbufsize / bytes_per_ele;
+    struct rfnm_soapy_partial_buf& partial = partial_rx_buf[channel];
+    size_t read_elems = 0;
+
+    if (burst_active[channel] && !burst_left[channel]) {
+        return 0;
+    }
+
+    // sleep once until the clock model says the whole read has been captured, instead of waking
+    // for every buffer, but never hold on to samples for longer than the latency cap
+    long long batch_deadline_ns = 0;
+    if (batch_latency[channel].count() && timeoutUs > 0) {
+        long long now_ns = nowNs();
+        batch_deadline_ns = now_ns + std::min<long long>(batch_latency[channel].count(), timeoutUs) * 1000;
+
+        size_t have = partial.left / bytes_per_ele;
+        uint64_t next = 0;
+        bool known = false;
+        if (partial.left) {
+            next = partial.sample + have;
+            known = true;
+        } else {
+            std::lock_guard<std::mutex> lock(rx_clock_mutex);
+            if (rx_clock[channel].valid) {
+                next = (rx_clock[channel].cc + 1) * rx_clock[channel].elems;
+                known = true;
+            }
+        }
+
+        if (known && have < numElems) {
+            // a buffer is only handed over once it is complete
+            uint64_t last = next + numElems - have;
+            last = (last + elems_per_buf - 1) / elems_per_buf * elems_per_buf;
+            long long ready_ns = std::min(timeAtSample(channel, last), batch_deadline_ns);
+            if (ready_ns > now_ns) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(ready_ns - now_ns));
+            }
+        }
+    }
+
+    while (read_elems < numElems) {
+        struct librfnm_rx_buf* lrxbuf = nullptr;
+        uint8_t* src;
+        uint64_t sample;
+        size_t n;
+
+        if (partial.left) {
+            src = partial.buf + partial.offset;
+            sample = partial.sample;
+            n = partial.left / bytes_per_ele;
+        } else {
+            int64_t wait_us = 0;
+
+            if (timeoutUs > 0) {
+                auto time_remaining = timeout - std::chrono::system_clock::now();
+                if (time_remaining > std::chrono::duration<int64_t>::zero()) {
+                    wait_us = std::chrono::duration_cast<std::chrono::microseconds>(time_remaining).count();
+                }
+            }
 
-    // stop the ADCs
-    uint16_t apply_mask = 0;
-    for (size_t i = 0; i < rx_chan_count; i++) {
-        if (lrfnm->s->rx.ch[i].enable != RFNM_CH_OFF) {
-            lrfnm->s->rx.ch[i].enable = RFNM_CH_OFF;
-            apply_mask |= librfnm_rx_chan_apply[i];
+            // with batching, what has arrived by the latency cap is returned as a short read
+            if (batch_deadline_ns && read_elems) {
+                wait_us = std::clamp<int64_t>((batch_deadline_ns - nowNs()) / 1000, 0, wait_us);
+            }
+
+            if (dequeue(channel, &lrxbuf, wait_us)) {
+                if (timeoutUs >= 10000) {
+                    spdlog::info("read timeout, got {} of {} within {} us", read_elems, numElems, timeoutUs);
+                }
+                break;
+            }
+
+            sample = observeClock(channel, lrxbuf->usb_cc);
+            src = lrxbuf->buf;
+
+            if (burst_start_pending[channel]) {
+                std::lock_guard<std::mutex> lock(rx_event_mutex);
+                rx_discard_until[channel] = std::max(rx_discard_until[channel], sampleAtTime(channel, burst_start_ns[channel]));
+                burst_start_pending[channel] = false;
+            }
+            n = elems_per_buf;
+
+            if (dc_seed_pending[channel]) {
+                takeDcSeed(channel);
+            }
+
+            bool streaming = dc_correction[channel] && dc_estimator == RFNM_SOAPY_DC_STREAMING;
+            bool tracked = false;
+            if (dc_init_pending[channel]) {
+                // initial calibration deferred from activateStream or after a retune without cached offsets
+                measDcOffset(channel, lrxbuf->buf, 1.0f);
+                dc_init_pending[channel] = false;
+            } else if (streaming && !iq_correction[channel]) {
+                // track drift in the correction pass itself
+                trackDcOffset(channel, lrxbuf->buf, 1.0f / dc_time_constant);
+                tracked = true;
+            } else if (dc_correction[channel] && !streaming && (lrxbuf->usb_cc % dc_update_interval) == 0) {
+                // periodically recalibrate DC offset to account for drift
+                measDcOffset(channel, lrxbuf->buf, std::min(1.0f, static_cast<float>(dc_update_interval) / dc_time_constant));
+            }
+
+            if (iq_correction[channel]) {
+                // DC and IQ balance share one pass over the buffer
+                applyDcIqBalance(channel, lrxbuf->buf, streaming ? 1.0f / dc_time_constant : 0.0f);
+            } else if (dc_correction[channel] && !tracked) {
+                applyDcOffset(channel, lrxbuf->buf);
+            }
+        }
+
+        // drop settling samples and stop the read where a hop or timed command landed
+        size_t skip = 0;
+        size_t limit = n;
+        bool boundary = false;
+        {
+            std::lock_guard<std::mutex> lock(rx_event_mutex);
+            while (true) {
+                if (sample + skip < rx_discard_until[channel]) {
+                    skip = std::min<uint64_t>(n, rx_discard_until[channel] - sample);
+                }
+
+                if (rx_events[channel].empty()) {
+                    break;
+                }
+
+                const struct rfnm_soapy_rx_event& ev = rx_events[channel].front();
+                if (ev.start >= sample + n) {
+                    break;
+                }
+
+                if (read_elems || ev.start > sample + skip) {
+                    limit = ev.start > sample ? ev.start - sample : 0;
+                    boundary = true;
+                    break;
+                }
+
+                // this read starts on the boundary, switch over to the new settings
+                rx_discard_until[channel] = ev.valid;
+                if (ev.hop) {
+                    hop_index[channel] = ev.index;
+                }
+                rx_events[channel].pop_front();
+            }
+        }
+
+        size_t take = limit > skip ? std::min(limit - skip, numElems - read_elems) : 0;
+        if (burst_active[channel]) {
+            take = std::min(take, burst_left[channel]);
+        }
+
+        if (take && !read_elems) {
+            flags |= SOAPY_SDR_HAS_TIME;
+            timeNs = timeAtSample(channel, sample + skip);
+        }
+
+        switch (lrfnm->s->transport_status.rx_stream_format) {
+        case LIBRFNM_STREAM_FORMAT_CS8:
+            copyQuadStats(reinterpret_cast<int8_t *>(dst) + 2 * read_elems, reinterpret_cast<int8_t *>(src) + 2 * skip,
+                    2 * take, stats);
+            break;
+        case LIBRFNM_STREAM_FORMAT_CS16:
+            copyQuadStats(reinterpret_cast<int16_t *>(dst) + 2 * read_elems, reinterpret_cast<int16_t *>(src) + 2 * skip,
+                    2 * take, stats);
+            break;
+        case LIBRFNM_STREAM_FORMAT_CF32:
+            copyQuadStats(reinterpret_cast<float *>(dst) + 2 * read_elems, reinterpret_cast<float *>(src) + 2 * skip,
+                    2 * take, stats);
+            break;
+        }
+        read_elems += take;
+
+        size_t consumed = skip + take;
+        if (lrxbuf) {
+            if (consumed < n) {
+                std::memcpy(partial.buf, src + (bytes_per_ele * consumed), bytes_per_ele * (n - consumed));
+                partial.left = bytes_per_ele * (n - consumed);
+                partial.offset = 0;
+            }
+            partial.sample = sample + consumed;
+            lrfnm->rx_qbuf(lrxbuf);
+        } else {
+            partial.left -= bytes_per_ele * consumed;
+            partial.offset += bytes_per_ele * consumed;
+            partial.sample += consumed;
+        }
+
+        if (burst_active[channel]) {
+            burst_left[channel] -= take;
+            if (!burst_left[channel]) {
+                flags |= SOAPY_SDR_END_BURST;
+                break;
+            }
+        }
+
+        if (boundary && consumed >= limit) {
+            flags |= SOAPY_SDR_END_BURST;
+            break;
+        }
+    }
+
+    return read_elems;
+}
+
+void SoapyRFNM::publishStats(size_t channel, const struct rfnm_soapy_rx_stats& stats, long long time_ns) {
+    if (!stats.values) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        rx_stats[channel] = stats;
+        rx_clipped[channel] += stats.clipped;
+    }
+
+    // hand the level to the AGC thread, the gain change itself never runs on the reader
+    if (agc_enabled[channel]) {
+        {
+            std::lock_guard<std::mutex> lock(agc_mutex);
+            struct rfnm_soapy_agc_meas& meas = agc_meas[channel];
+            meas.pending = true;
+            meas.power_dbfs = 10.0f * std::log10(std::max(2.0 * stats.power / stats.values, 1e-12));
+            meas.clipped = stats.clipped != 0;
+            meas.time_ns = time_ns;
+        }
+        agc_cv.notify_one();
+    }
+}
+
+std::unique_ptr<struct rfnm_soapy_sweep> SoapyRFNM::setupSweep(size_t channel, const SoapySDR::Kwargs& args) {
+    auto sw = std::make_unique<struct rfnm_soapy_sweep>();
+    double rate = getSampleRate(SOAPY_SDR_RX, channel);
+
+    double start = std::stod(args.at("sweep_start"));
+    double stop = args.count("sweep_stop") ? std::stod(args.at("sweep_stop")) : start;
+    double usable = args.count("sweep_usable") ? std::stod(args.at("sweep_usable")) : 0.75;
+    double settle_us = args.count("sweep_settle_us") ? std::stod(args.at("sweep_settle_us")) : 100;
+    sw->fft_size = args.count("sweep_fft_size") ? std::stoul(args.at("sweep_fft_size")) : 1024;
+    sw->averages = args.count("sweep_averages") ? std::stoul(args.at("sweep_averages")) : 8;
+
+    if (sw->fft_size < 16 || (sw->fft_size & (sw->fft_size - 1))) {
+        throw std::runtime_error("sweep_fft_size must be a power of two >= 16");
+    }
+    if (!sw->averages) {
+        throw std::runtime_error("sweep_averages must be at least 1");
+    }
+    if (usable <= 0.0 || usable > 1.0) {
+        throw std::runtime_error("sweep_usable must be in (0, 1]");
+    }
+    if (stop < start || start < lrfnm->s->rx.ch[channel].freq_min || stop > lrfnm->s->rx.ch[channel].freq_max) {
+        throw std::runtime_error("sweep range outside of the channel frequency range");
+    }
+
+    // keep the step a whole number of bins so neighbouring steps stitch without gaps or overlap
+    sw->bins_per_step = std::max<size_t>(2, static_cast<size_t>(usable * sw->fft_size) & ~size_t(1));
+    double step_bw = sw->bins_per_step * rate / sw->fft_size;
+    size_t steps = std::max<size_t>(1, static_cast<size_t>(std::ceil((stop - start) / step_bw)));
+    for (size_t k = 0; k < steps; k++) {
+        sw->centers.push_back(start + step_bw * k + step_bw / 2);
+    }
+    if (sw->centers.back() > lrfnm->s->rx.ch[channel].freq_max) {
+        throw std::runtime_error("last sweep step is tuned past the channel frequency range, lower sweep_stop");
+    }
+
+    sw->channel = channel;
+    // setupStream adds the buffer that may still be in flight once the session sets the buffer size
+    sw->settle_elems = static_cast<size_t>(rate * settle_us / 1e6);
+
+    sw->window.resize(sw->fft_size);
+    sw->window_power = 0;
+    for (size_t i = 0; i < sw->fft_size; i++) {
+        sw->window[i] = 0.5f - 0.5f * std::cos(2.0f * std::numbers::pi_v<float> * i / sw->fft_size);
+        sw->window_power += sw->window[i] * sw->window[i];
+    }
+    sw->window_power *= sw->fft_size;
+
+    sw->twiddles.resize(sw->fft_size / 2);
+    for (size_t i = 0; i < sw->fft_size / 2; i++) {
+        sw->twiddles[i] = std::polar(1.0f, -2.0f * std::numbers::pi_v<float> * i / sw->fft_size);
+    }
+
+    sw->fft_buf.resize(sw->fft_size);
+    sw->psd.resize(sw->fft_size);
+    sw->capture.resize(sw->fft_size * sw->averages);
+    sw->captured = 0;
+    sw->step = 0;
+    sw->pending.resize(steps * sw->bins_per_step);
+    sw->output.resize(steps * sw->bins_per_step);
+    sw->output_offset = sw->output.size();
+
+    spdlog::info("sweep of {} steps, {} bins of {} Hz", steps, sw->output.size(), rate / sw->fft_size);
+
+    return sw;
+}
+
+void SoapyRFNM::tuneSweep(size_t step) {
+    std::lock_guard<std::mutex> lock(config_mutex);
+    lrfnm->s->rx.ch[sweep->channel].freq = sweep->centers[step];
+    setRFNM(librfnm_rx_chan_apply[sweep->channel]);
+
+    // anything queued so far was captured on the previous step
+    lrfnm->rx_flush(0);
+}
+
+int SoapyRFNM::readSweep(void* const* buffs, const size_t numElems, int& flags, const long timeoutUs) {
+    flags = 0;
+    auto timeout = std::chrono::system_clock::now() + std::chrono::microseconds(timeoutUs);
+    size_t elems_per_buf = outbufsize / LIBRFNM_STREAM_FORMAT_CF32;
+    struct librfnm_rx_buf* lrxbuf;
+
+    while (sweep->output_offset >= sweep->output.size()) {
+        uint32_t wait_ms = 0;
+
+        auto time_remaining = timeout - std::chrono::system_clock::now();
+        if (time_remaining > std::chrono::duration<int64_t>::zero()) {
+            wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_remaining).count();
+        } else if (timeoutUs > 0) {
+            return SOAPY_SDR_TIMEOUT;
+        }
+
+        if (lrfnm->rx_dqbuf(&lrxbuf, librfnm_rx_chan_flags[sweep->channel], wait_ms)) {
+            return SOAPY_SDR_TIMEOUT;
+        }
+
+        auto *samples = reinterpret_cast<std::complex<float> *>(lrxbuf->buf);
+        size_t skip = std::min(sweep->settle_left, elems_per_buf);
+        size_t take = std::min(elems_per_buf - skip, sweep->capture.size() - sweep->captured);
+        std::copy(samples + skip, samples + skip + take, sweep->capture.begin() + sweep->captured);
+        sweep->settle_left -= skip;
+        sweep->captured += take;
+        lrfnm->rx_qbuf(lrxbuf);
+
+        if (sweep->captured < sweep->capture.size()) {
+            continue;
+        }
+
+        // the next step settles while this one is transformed
+        size_t next = (sweep->step + 1) % sweep->centers.size();
+        if (sweep->centers.size() > 1) {
+            sweep->retune = std::async(std::launch::async, [this, next] { tuneSweep(next); });
+        }
+
+        sweepPowerSpectrum(*sweep, dc_correction[sweep->channel],
+                sweep->pending.data() + sweep->step * sweep->bins_per_step);
+
+        sweep->captured = 0;
+        sweep->settle_left = sweep->settle_elems;
+        sweep->step = next;
+        if (next == 0) {
+            std::swap(sweep->pending, sweep->output);
+            sweep->output_offset = 0;
+        }
+
+        if (sweep->retune.valid()) {
+            sweep->retune.get();
+        }
+    }
+
+    size_t n = std::min(numElems, sweep->output.size() - sweep->output_offset);
+    std::memcpy(buffs[0], sweep->output.data() + sweep->output_offset, n * sizeof(float));
+    sweep->output_offset += n;
+
+    if (sweep->output_offset == sweep->output.size()) {
+        flags |= SOAPY_SDR_END_BURST;
+    }
+
+    return n;
+}
+
+void SoapyRFNM::resetClock(size_t channel) {
+    std::lock_guard<std::mutex> lock(rx_clock_mutex);
+    struct rfnm_soapy_cc_clock& clk = rx_clock[channel];
+
+    clk.valid = false;
+    clk.elems = outbufsize / std::max<size_t>(1, lrfnm->s->transport_status.rx_stream_format);
+    clk.div_n = lrfnm->s->rx.ch[channel].samp_freq_div_n;
+    clk.period_ns = clk.elems * 1e9 / (lrfnm->s->hwinfo.clock.dcs_clk / clk.div_n);
+}
+
+uint64_t SoapyRFNM::observeClock(size_t channel, uint32_t usb_cc) {
+    std::lock_guard<std::mutex> lock(rx_clock_mutex);
+    struct rfnm_soapy_cc_clock& clk = rx_clock[channel];
+    double now = nowNs();
+
+    if (!clk.valid) {
+        clk.cc = usb_cc;
+        clk.origin_ns = now - (clk.cc + 1) * clk.period_ns;
+        clk.valid = true;
+    } else {
+        clk.cc += static_cast<int32_t>(usb_cc - static_cast<uint32_t>(clk.cc));
+    }
+
+    // A buffer only arrives once its last sample was captured, so buffer cc starts at least
+    // one period before its arrival. USB latency only ever makes arrivals later, so the
+    // earliest one is the best estimate of the capture timeline. Creep towards later
+    // arrivals to follow clock drift.
+    double origin = now - (clk.cc + 1) * clk.period_ns;
+    if (origin < clk.origin_ns) {
+        clk.origin_ns = origin;
+    } else {
+        clk.origin_ns += (origin - clk.origin_ns) / 4096;
+    }
+
+    return clk.cc * clk.elems;
+}
+
+uint64_t SoapyRFNM::sampleAtTime(size_t channel, long long ns) const {
+    std::lock_guard<std::mutex> lock(rx_clock_mutex);
+    const struct rfnm_soapy_cc_clock& clk = rx_clock[channel];
+
+    if (!clk.valid || ns <= clk.origin_ns) {
+        return 0;
+    }
+
+    return static_cast<uint64_t>((ns - clk.origin_ns) / clk.period_ns * clk.elems);
+}
+
+long long SoapyRFNM::timeAtSample(size_t channel, uint64_t sample) const {
+    std::lock_guard<std::mutex> lock(rx_clock_mutex);
+    const struct rfnm_soapy_cc_clock& clk = rx_clock[channel];
+
+    return static_cast<long long>(clk.origin_ns + static_cast<double>(sample) / clk.elems * clk.period_ns);
+}
+
+void SoapyRFNM::pushRxEvent(size_t channel, struct rfnm_soapy_rx_event ev) {
+    std::lock_guard<std::mutex> lock(rx_event_mutex);
+    rx_events[channel].push_back(ev);
+}
+
+void SoapyRFNM::startHopping() {
+    std::lock_guard<std::mutex> lock(hop_mutex);
+
+    if (hop_table.empty() || !stream_active || sweep || hop_thread.joinable()) {
+        return;
+    }
+
+    hop_stop = false;
+    hop_thread = std::thread(&SoapyRFNM::hopLoop, this);
+}
+
+void SoapyRFNM::stopHopping() {
+    {
+        std::lock_guard<std::mutex> lock(hop_mutex);
+        hop_stop = true;
+    }
+    hop_cv.notify_all();
+
+    if (hop_thread.joinable()) {
+        hop_thread.join();
+    }
+}
+
+void SoapyRFNM::hopLoop() {
+    std::unique_lock<std::mutex> lock(hop_mutex);
+    size_t idx = 0;
+
+    while (!hop_stop) {
+        struct rfnm_soapy_hop hop = hop_table[idx];
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> config_lock(config_mutex);
+            uint16_t apply_mask = 0;
+            for (size_t channel = 0; channel < rx_chan_count; channel++) {
+                if (lrfnm->s->rx.ch[channel].enable == RFNM_CH_ON) {
+                    lrfnm->s->rx.ch[channel].freq = hop.freq;
+                    apply_mask |= librfnm_rx_chan_apply[channel];
+                }
+            }
+
+            // setRFNM tags the stream with the hop boundary
+            try {
+                setRFNM(apply_mask, idx);
+            } catch (const std::runtime_error& e) {
+                spdlog::error("hop {} to {} Hz failed: {}", idx, hop.freq, e.what());
+            }
+        }
+        long long valid_ns = nowNs() + std::chrono::duration_cast<std::chrono::nanoseconds>(hop_settle).count();
+
+        lock.lock();
+        idx = (idx + 1) % hop_table.size();
+
+        auto dwell_end = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(valid_ns)) + hop.dwell;
+        hop_cv.wait_until(lock, dwell_end, [this] { return hop_stop; });
+    }
+}
+
+std::vector<std::string> SoapyRFNM::listSensors() const {
+    std::vector<std::string> sensors;
+    sensors.push_back("applies_avoided");
+    sensors.push_back("apply_status");
+    return sensors;
+}
+
+SoapySDR::ArgInfo SoapyRFNM::getSensorInfo(const std::string& key) const {
+    SoapySDR::ArgInfo info;
+    info.key = key;
+
+    if (key == "applies_avoided") {
+        info.name = "Applies Avoided";
+        info.description = "Channel applies skipped because the hardware already had the requested settings";
+        info.type = SoapySDR::ArgInfo::INT;
+    } else if (key == "apply_status") {
+        info.name = "Apply Status";
+        info.description = "Outcome of the last asynchronous apply, \"ok\" or the error message";
+        info.type = SoapySDR::ArgInfo::STRING;
+    }
+
+    return info;
+}
+
+std::string SoapyRFNM::readSensor(const std::string& key) const {
+    if (key == "applies_avoided") {
+        return std::to_string(applies_avoided.load());
+    } else if (key == "apply_status") {
+        std::lock_guard<std::mutex> lock(status_mutex);
+        return apply_status;
+    }
+
+    throw std::runtime_error("unknown sensor " + key);
+}
+
+std::vector<std::string> SoapyRFNM::listSensors(const int direction, const size_t channel) const {
+    std::vector<std::string> sensors;
+    if (direction == SOAPY_SDR_RX) {
+        sensors.push_back("hop_index");
+        sensors.push_back("power");
+        sensors.push_back("peak");
+        sensors.push_back("clipped");
+        sensors.push_back("busy_poll_load");
+        sensors.push_back("busy_poll_hits");
+    }
+    return sensors;
+}
+
+SoapySDR::ArgInfo SoapyRFNM::getSensorInfo(const int direction, const size_t channel, const std::string& key) const {
+    SoapySDR::ArgInfo info;
+    info.key = key;
+
+    if (key == "hop_index") {
+        info.name = "Hop Index";
+        info.description = "Hop table entry the samples of the last readStream were captured on";
+        info.type = SoapySDR::ArgInfo::INT;
+    } else if (key == "power") {
+        info.name = "Power";
+        info.description = "Mean power of the samples returned by the last readStream";
+        info.units = "dBFS";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    } else if (key == "peak") {
+        info.name = "Peak";
+        info.description = "Largest I or Q magnitude returned by the last readStream";
+        info.units = "dBFS";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+    } else if (key == "clipped") {
+        info.name = "Clipped";
+        info.description = "I and Q values returned at full scale since the stream was set up";
+        info.type = SoapySDR::ArgInfo::INT;
+    } else if (key == "busy_poll_load") {
+        info.name = "Busy Poll Load";
+        info.description = "Share of one core spent spinning for buffers since the stream was set up";
+        info.type = SoapySDR::ArgInfo::FLOAT;
+        info.range = SoapySDR::Range(0.0, 1.0);
+    } else if (key == "busy_poll_hits") {
+        info.name = "Busy Poll Hits";
+        info.description = "Buffers picked up while spinning, without a blocking wait";
+        info.type = SoapySDR::ArgInfo::INT;
+    }
+
+    return info;
+}
+
+std::string SoapyRFNM::readSensor(const int direction, const size_t channel, const std::string& key) const {
+    if (direction != SOAPY_SDR_RX || channel >= rx_chan_count) {
+        throw std::runtime_error("nonexistent channel");
+    }
+
+    if (key == "hop_index") {
+        std::lock_guard<std::mutex> lock(rx_event_mutex);
+        return std::to_string(hop_index[channel]);
+    } else if (key == "power") {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        const struct rfnm_soapy_rx_stats& stats = rx_stats[channel];
+        // a full scale complex tone is 0 dBFS
+        return std::to_string(10.0 * std::log10(stats.values ? 2.0 * stats.power / stats.values : 0.0));
+    } else if (key == "peak") {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        return std::to_string(20.0 * std::log10(rx_stats[channel].peak));
+    } else if (key == "clipped") {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        return std::to_string(rx_clipped[channel]);
+    } else if (key == "busy_poll_load") {
+        long long wall_ns = nowNs() - poll_since_ns[channel];
+        return std::to_string(wall_ns > 0 ? static_cast<double>(poll_spin_ns[channel]) / wall_ns : 0.0);
+    } else if (key == "busy_poll_hits") {
+        return std::to_string(poll_hits[channel]);
+    }
+
+    throw std::runtime_error("unknown sensor " + key);
+}
+
+SoapySDR::ArgInfoList SoapyRFNM::getSettingInfo(const int direction, const size_t channel) const {
+    SoapySDR::ArgInfoList settings;
+
+    if (direction == SOAPY_SDR_RX) {
+        SoapySDR::ArgInfo enable;
+        enable.key = "stream_enable";
+        enable.value = "true";
+        enable.name = "Stream Enable";
+        enable.description = "Switch the channel on or off inside its stream without disturbing the other channels. "
+                "readStream leaves the buffers of disabled channels untouched.";
+        enable.type = SoapySDR::ArgInfo::BOOL;
+        settings.push_back(enable);
+    }
+
+    return settings;
+}
+
+void SoapyRFNM::writeSetting(const int direction, const size_t channel, const std::string& key,
+        const std::string& value) {
+    if (direction != SOAPY_SDR_RX || channel >= rx_chan_count) {
+        throw std::runtime_error("nonexistent channel");
+    }
+
+    if (key == "stream_enable") {
+        bool enable = value == "true";
+        std::lock_guard<std::mutex> stream_lock(stream_mutex);
+
+        if (!stream_channels[channel]) {
+            throw std::runtime_error("channel is not part of a stream");
+        }
+        if (enable != channel_standby[channel]) {
+            return;
+        }
+
+        auto it = std::find_if(streams.begin(), streams.end(),
+                [channel](const std::unique_ptr<struct rfnm_soapy_stream>& st) {
+                    return std::find(st->channels.begin(), st->channels.end(), channel) != st->channels.end();
+                });
+        bool active = (*it)->active && !sweep;
+
+        if (enable) {
+            // an inactive stream brings the channel up in activateStream
+            if (active) {
+                startChannel(channel);
+            }
+            channel_standby[channel] = false;
+        } else {
+            channel_standby[channel] = true;
+            if (active) {
+                stopChannels({channel});
+            }
+        }
+        return;
+    }
+
+    throw std::runtime_error("unknown setting " + key);
+}
+
+std::string SoapyRFNM::readSetting(const int direction, const size_t channel, const std::string& key) const {
+    if (direction != SOAPY_SDR_RX || channel >= rx_chan_count) {
+        throw std::runtime_error("nonexistent channel");
+    }
+
+    if (key == "stream_enable") {
+        return channel_standby[channel] ? "false" : "true";
+    }
+
+    throw std::runtime_error("unknown setting " + key);
+}
+
+SoapySDR::ArgInfoList SoapyRFNM::getSettingInfo() const {
+    SoapySDR::ArgInfoList settings;
+
+    SoapySDR::ArgInfo table;
+    table.key = "hop_table";
+    table.name = "Hop Table";
+    table.description = "Comma separated freq_hz:dwell_us pairs hopped through by all enabled channels "
+            "while streaming. Each hop starts a new burst tagged with the time of its first settled "
+            "sample, see the hop_index sensor. Empty to stop hopping.";
+    table.type = SoapySDR::ArgInfo::STRING;
+    settings.push_back(table);
+
+    SoapySDR::ArgInfo defer;
+    defer.key = "defer_apply";
+    defer.value = "false";
+    defer.name = "Defer Apply";
+    defer.description = "Collect setter changes instead of applying each one. Setting this back to false, "
+            "writing the commit setting or setting up a stream applies them all in one transaction.";
+    defer.type = SoapySDR::ArgInfo::BOOL;
+    settings.push_back(defer);
+
+    SoapySDR::ArgInfo commit;
+    commit.key = "commit";
+    commit.name = "Commit";
+    commit.description = "Apply all deferred changes now, the value is ignored";
+    commit.type = SoapySDR::ArgInfo::STRING;
+    settings.push_back(commit);
+
+    SoapySDR::ArgInfo async;
+    async.key = "async_apply";
+    async.value = "false";
+    async.name = "Asynchronous Apply";
+    async.description = "Setters return immediately and a config thread applies the changes, coalescing "
+            "everything queued while an apply was in progress. Outcomes are reported by readStreamStatus "
+            "and the apply_status sensor.";
+    async.type = SoapySDR::ArgInfo::BOOL;
+    settings.push_back(async);
+
+    SoapySDR::ArgInfo cache;
+    cache.key = "shadow_cache";
+    cache.value = "true";
+    cache.name = "Shadow Cache";
+    cache.description = "Skip channel applies that would not change the last settings applied successfully";
+    cache.type = SoapySDR::ArgInfo::BOOL;
+    settings.push_back(cache);
+
+    SoapySDR::ArgInfo restart;
+    restart.key = "fast_restart";
+    restart.value = "false";
+    restart.name = "Fast Restart";
+    restart.description = "Keep the receive path running after the last closeStream, so the next setupStream "
+            "with the same format starts within about one buffer period";
+    restart.type = SoapySDR::ArgInfo::BOOL;
+    settings.push_back(restart);
+
+    SoapySDR::ArgInfo target;
+    target.key = "agc_target";
+    target.value = "-20";
+    target.name = "AGC Target";
+    target.description = "Mean power the automatic gain control steers towards";
+    target.units = "dBFS";
+    target.type = SoapySDR::ArgInfo::FLOAT;
+    settings.push_back(target);
+
+    SoapySDR::ArgInfo hysteresis;
+    hysteresis.key = "agc_hysteresis";
+    hysteresis.value = "3";
+    hysteresis.name = "AGC Hysteresis";
+    hysteresis.description = "Distance from the target the power may wander before the gain is changed";
+    hysteresis.units = "dB";
+    hysteresis.type = SoapySDR::ArgInfo::FLOAT;
+    settings.push_back(hysteresis);
+
+    SoapySDR::ArgInfo estimator;
+    estimator.key = "dc_estimator";
+    estimator.value = "periodic";
+    estimator.name = "DC Estimator";
+    estimator.description = "periodic: re-measure the DC offset every dc_update_interval buffers. "
+            "streaming: fold the measurement into the correction pass of every buffer.";
+    estimator.type = SoapySDR::ArgInfo::STRING;
+    estimator.options = {"periodic", "streaming"};
+    settings.push_back(estimator);
+
+    SoapySDR::ArgInfo interval;
+    interval.key = "dc_update_interval";
+    interval.value = "16";
+    interval.name = "DC Update Interval";
+    interval.description = "Buffers between DC offset measurements of the periodic estimator";
+    interval.type = SoapySDR::ArgInfo::INT;
+    settings.push_back(interval);
+
+    SoapySDR::ArgInfo time_constant;
+    time_constant.key = "dc_time_constant";
+    time_constant.value = "160";
+    time_constant.name = "DC Time Constant";
+    time_constant.description = "Time constant of the DC offset tracking filter";
+    time_constant.units = "buffers";
+    time_constant.type = SoapySDR::ArgInfo::FLOAT;
+    settings.push_back(time_constant);
+
+    SoapySDR::ArgInfo settle_mode_info;
+    settle_mode_info.key = "settle_mode";
+    settle_mode_info.value = "discard";
+    settle_mode_info.name = "Settle Mode";
+    settle_mode_info.description = "What readStream does with samples captured while an apply on a streaming "
+            "channel settled: drop them, or deliver them but start a new read on the first valid "
+            "sample. Either way that read has HAS_TIME set to the time of that sample, the read before it "
+            "has END_BURST, and readStreamStatus reports the same time.";
+    settle_mode_info.type = SoapySDR::ArgInfo::STRING;
+    settle_mode_info.options = {"discard", "tag", "off"};
+    settings.push_back(settle_mode_info);
+
+    SoapySDR::ArgInfo settle_us;
+    settle_us.key = "settle_us";
+    settle_us.value = "100";
+    settle_us.name = "Settling Time";
+    settle_us.description = "Time after an apply completed before samples are considered valid";
+    settle_us.units = "us";
+    settle_us.type = SoapySDR::ArgInfo::INT;
+    settings.push_back(settle_us);
+
+    SoapySDR::ArgInfo settle;
+    settle.key = "hop_settle_us";
+    settle.value = "100";
+    settle.name = "Hop Settling Time";
+    settle.description = "Samples dropped after each hop has been applied";
+    settle.units = "us";
+    settle.type = SoapySDR::ArgInfo::INT;
+    settings.push_back(settle);
+
+    return settings;
+}
+
+void SoapyRFNM::writeSetting(const std::string& key, const std::string& value) {
+    if (key == "hop_table") {
+        std::vector<struct rfnm_soapy_hop> table;
+        size_t pos = 0;
+
+        while (pos < value.size()) {
+            size_t end = value.find(',', pos);
+            if (end == std::string::npos) {
+                end = value.size();
+            }
+
+            std::string entry = value.substr(pos, end - pos);
+            size_t colon = entry.find(':');
+            if (colon == std::string::npos) {
+                throw std::runtime_error("hop_table entries must be freq_hz:dwell_us");
+            }
+
+            struct rfnm_soapy_hop hop;
+            hop.freq = std::stod(entry.substr(0, colon));
+            hop.dwell = std::chrono::microseconds(std::stoll(entry.substr(colon + 1)));
+            if (hop.dwell.count() <= 0) {
+                throw std::runtime_error("hop dwell must be positive");
+            }
+            table.push_back(hop);
+
+            pos = end + 1;
+        }
+
+        stopHopping();
+        {
+            std::lock_guard<std::mutex> lock(hop_mutex);
+            hop_table = std::move(table);
+        }
+        startHopping();
+    } else if (key == "hop_settle_us") {
+        std::lock_guard<std::mutex> lock(hop_mutex);
+        hop_settle = std::chrono::microseconds(std::stoll(value));
+    } else if (key == "fast_restart") {
+        fast_restart = value == "true";
+    } else if (key == "agc_target") {
+        agc_target = std::stof(value);
+    } else if (key == "agc_hysteresis") {
+        float hysteresis = std::stof(value);
+        if (hysteresis < 0.0f) {
+            throw std::runtime_error("agc_hysteresis must not be negative");
+        }
+        agc_hysteresis = hysteresis;
+    } else if (key == "dc_estimator") {
+        if (value == "periodic") {
+            dc_estimator = RFNM_SOAPY_DC_PERIODIC;
+        } else if (value == "streaming") {
+            dc_estimator = RFNM_SOAPY_DC_STREAMING;
+        } else {
+            throw std::runtime_error("dc_estimator must be periodic or streaming");
+        }
+    } else if (key == "dc_update_interval") {
+        int interval = std::stoi(value);
+        if (interval < 1) {
+            throw std::runtime_error("dc_update_interval must be at least 1");
+        }
+        dc_update_interval = interval;
+    } else if (key == "dc_time_constant") {
+        float time_constant = std::stof(value);
+        if (time_constant < 1.0f) {
+            throw std::runtime_error("dc_time_constant must be at least 1 buffer");
+        }
+        dc_time_constant = time_constant;
+    } else if (key == "settle_mode") {
+        std::lock_guard<std::mutex> lock(apply_mutex);
+        if (value == "discard") {
+            settle_mode = RFNM_SOAPY_SETTLE_DISCARD;
+        } else if (value == "tag") {
+            settle_mode = RFNM_SOAPY_SETTLE_TAG;
+        } else if (value == "off") {
+            settle_mode = RFNM_SOAPY_SETTLE_OFF;
+        } else {
+            throw std::runtime_error("settle_mode must be discard, tag or off");
+        }
+    } else if (key == "settle_us") {
+        std::lock_guard<std::mutex> lock(apply_mutex);
+        settle_time = std::chrono::microseconds(std::stoll(value));
+    } else if (key == "defer_apply") {
+        bool defer = (value == "true" || value == "1");
+        {
+            std::lock_guard<std::mutex> lock(staging_mutex);
+            defer_apply = defer;
+        }
+        if (!defer) {
+            commitRFNM();
+        }
+    } else if (key == "commit") {
+        commitRFNM();
+    } else if (key == "async_apply") {
+        if (value == "true" || value == "1") {
+            startApplying();
+        } else {
+            stopApplying();
+        }
+    } else if (key == "shadow_cache") {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        shadow_cache = (value == "true" || value == "1");
+    } else {
+        throw std::runtime_error("unknown setting " + key);
+    }
+}
+
+std::string SoapyRFNM::readSetting(const std::string& key) const {
+    if (key == "defer_apply") {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        return defer_apply ? "true" : "false";
+    } else if (key == "shadow_cache") {
+        return shadow_cache ? "true" : "false";
+    } else if (key == "settle_mode") {
+        switch (settle_mode) {
+        case RFNM_SOAPY_SETTLE_DISCARD:
+            return "discard";
+        case RFNM_SOAPY_SETTLE_TAG:
+            return "tag";
+        case RFNM_SOAPY_SETTLE_OFF:
+            return "off";
+        }
+    } else if (key == "settle_us") {
+        return std::to_string(settle_time.count());
+    } else if (key == "fast_restart") {
+        return fast_restart ? "true" : "false";
+    } else if (key == "agc_target") {
+        return std::to_string(agc_target);
+    } else if (key == "agc_hysteresis") {
+        return std::to_string(agc_hysteresis);
+    } else if (key == "dc_estimator") {
+        return dc_estimator == RFNM_SOAPY_DC_STREAMING ? "streaming" : "periodic";
+    } else if (key == "dc_update_interval") {
+        return std::to_string(dc_update_interval);
+    } else if (key == "dc_time_constant") {
+        return std::to_string(dc_time_constant);
+    } else if (key == "async_apply") {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        return apply_running ? "true" : "false";
+    }
+
+    std::lock_guard<std::mutex> lock(hop_mutex);
+
+    if (key == "hop_table") {
+        std::string table;
+        for (auto& hop : hop_table) {
+            if (!table.empty()) {
+                table += ",";
+            }
+            table += std::to_string(static_cast<uint64_t>(hop.freq)) + ":" + std::to_string(hop.dwell.count());
         }
+        return table;
+    } else if (key == "hop_settle_us") {
+        return std::to_string(hop_settle.count());
     }
-    setRFNM(apply_mask);
 
-    // flush buffers
-    lrfnm->rx_flush(0);
+    throw std::runtime_error("unknown setting " + key);
+}
 
-    stream_setup = false;
+bool SoapyRFNM::hasIQBalanceMode(const int direction, const size_t channel) const {
+    return direction == SOAPY_SDR_RX;
 }
 
-int SoapyRFNM::readStream(SoapySDR::Stream* stream, void* const* buffs, const size_t numElems, int& flags,
-        long long int& timeNs, const long timeoutUs) {
-    auto timeout = std::chrono::system_clock::now() + std::chrono::microseconds(timeoutUs);
-    size_t bytes_per_ele = lrfnm->s->transport_status.rx_stream_format;
-    struct librfnm_rx_buf* lrxbuf;
-    size_t read_elems = 0;
-    size_t buf_idx = 0;
+void SoapyRFNM::setIQBalanceMode(const int direction, const size_t channel, const bool automatic) {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
 
-    // TODO: keep usb_cc of each channel in sync
+        if (automatic && !iq_correction[channel]) {
+            iq_balance[channel] = {};
+        }
+        iq_correction[channel] = automatic;
+    }
+}
 
-    for (size_t channel = 0; channel < MAX_RX_CHAN_COUNT; channel++) {
-        if (lrfnm->s->rx.ch[channel].enable != RFNM_CH_ON) {
-            continue;
+bool SoapyRFNM::getIQBalanceMode(const int direction, const size_t channel) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
         }
 
-        read_elems = 0;
+        return iq_correction[channel];
+    } else {
+        return false;
+    }
+}
+
+bool SoapyRFNM::hasGainMode(const int direction, const size_t channel) const {
+    return direction == SOAPY_SDR_RX;
+}
 
-        if (partial_rx_buf[channel].left) {
-            size_t can_write_bytes = numElems * bytes_per_ele;
-            if (can_write_bytes > partial_rx_buf[channel].left) {
-                can_write_bytes = partial_rx_buf[channel].left;
-            }
+void SoapyRFNM::setGainMode(const int direction, const size_t channel, const bool automatic) {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
 
-            std::memcpy(((uint8_t*)buffs[buf_idx]), partial_rx_buf[channel].buf + partial_rx_buf[channel].offset, can_write_bytes);
-            read_elems += (can_write_bytes / bytes_per_ele);
+        {
+            std::lock_guard<std::mutex> lock(agc_mutex);
+            agc_meas[channel] = {};
+            agc_enabled[channel] = automatic;
+        }
 
-            partial_rx_buf[channel].left -= can_write_bytes;
-            partial_rx_buf[channel].offset += can_write_bytes;
+        if (automatic) {
+            startAgc();
         }
+    }
+}
 
-        while (read_elems < numElems) {
-            uint32_t wait_ms = 0;
-            size_t overflowing_by_elems = 0;
-            size_t can_copy_bytes = outbufsize;
+bool SoapyRFNM::getGainMode(const int direction, const size_t channel) const {
+    if (direction == SOAPY_SDR_RX) {
+        if (channel >= rx_chan_count) {
+            throw std::runtime_error("nonexistent channel");
+        }
 
-            if (timeoutUs > 0) {
-                auto time_remaining = timeout - std::chrono::system_clock::now();
-                if (time_remaining > std::chrono::duration<int64_t>::zero()) {
-                    wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_remaining).count();
-                }
-            }
+        return agc_enabled[channel];
+    } else {
+        return false;
+    }
+}
 
-            if (lrfnm->rx_dqbuf(&lrxbuf, librfnm_rx_chan_flags[channel], wait_ms)) {
-                if (timeoutUs >= 10000) {
-                    spdlog::info("read timeout, got {} of {} within {} us", read_elems, numElems, timeoutUs);
-                }
-                break;
-            }
+void SoapyRFNM::startAgc() {
+    std::lock_guard<std::mutex> lock(agc_mutex);
 
-            if (dc_correction[channel]) {
-                // periodically recalibrate DC offset to account for drift
-                if ((lrxbuf->usb_cc & 0xF) == 0) {
-                    switch (lrfnm->s->transport_status.rx_stream_format) {
-                    case LIBRFNM_STREAM_FORMAT_CS8:
-                        measQuadDcOffset(reinterpret_cast<int8_t *>(lrxbuf->buf), outbufsize, dc_offsets[channel].i8, 0.1f);
-                        break;
-                    case LIBRFNM_STREAM_FORMAT_CS16:
-                        measQuadDcOffset(reinterpret_cast<int16_t *>(lrxbuf->buf), outbufsize / 2, dc_offsets[channel].i16, 0.1f);
-                        break;
-                    case LIBRFNM_STREAM_FORMAT_CF32:
-                        measQuadDcOffset(reinterpret_cast<float *>(lrxbuf->buf), outbufsize / 4, dc_offsets[channel].f32, 0.1f);
-                        break;
-                    }
-                }
+    if (agc_thread.joinable()) {
+        return;
+    }
 
-                switch (lrfnm->s->transport_status.rx_stream_format) {
-                case LIBRFNM_STREAM_FORMAT_CS8:
-                    applyQuadDcOffset(reinterpret_cast<int8_t *>(lrxbuf->buf), outbufsize, dc_offsets[channel].i8);
-                    break;
-                case LIBRFNM_STREAM_FORMAT_CS16:
-                    applyQuadDcOffset(reinterpret_cast<int16_t *>(lrxbuf->buf), outbufsize / 2, dc_offsets[channel].i16);
-                    break;
-                case LIBRFNM_STREAM_FORMAT_CF32:
-                    applyQuadDcOffset(reinterpret_cast<float *>(lrxbuf->buf), outbufsize / 4, dc_offsets[channel].f32);
-                    break;
-                }
-            }
+    agc_stop = false;
+    agc_thread = std::thread(&SoapyRFNM::agcLoop, this);
+}
 
-            if ((read_elems + (outbufsize / bytes_per_ele)) > numElems) {
+void SoapyRFNM::stopAgc() {
+    {
+        std::lock_guard<std::mutex> lock(agc_mutex);
+        agc_stop = true;
+    }
+    agc_cv.notify_all();
 
-                overflowing_by_elems = (read_elems + (outbufsize / bytes_per_ele)) - numElems;
-                can_copy_bytes = outbufsize - (overflowing_by_elems * bytes_per_ele);
-            }
+    if (agc_thread.joinable()) {
+        agc_thread.join();
+    }
+}
 
-            std::memcpy(((uint8_t*)buffs[buf_idx]) + (bytes_per_ele * read_elems), lrxbuf->buf, can_copy_bytes);
+void SoapyRFNM::agcLoop() {
+    std::unique_lock<std::mutex> lock(agc_mutex);
 
-            if (overflowing_by_elems) {
-                std::memcpy(partial_rx_buf[channel].buf, (lrxbuf->buf + can_copy_bytes), outbufsize - can_copy_bytes);
-                partial_rx_buf[channel].left = outbufsize - can_copy_bytes;
-                partial_rx_buf[channel].offset = 0;
-            }
+    while (true) {
+        agc_cv.wait(lock, [this] {
+            return agc_stop || std::any_of(std::begin(agc_meas), std::end(agc_meas),
+                    [](const struct rfnm_soapy_agc_meas& m) { return m.pending; });
+        });
 
-            lrfnm->rx_qbuf(lrxbuf);
-            read_elems += (outbufsize / bytes_per_ele) - overflowing_by_elems;
+        if (agc_stop) {
+            break;
         }
 
-        buf_idx++;
-    }
+        for (size_t channel = 0; channel < rx_chan_count; channel++) {
+            struct rfnm_soapy_agc_meas meas = agc_meas[channel];
+            agc_meas[channel].pending = false;
 
-    return read_elems;
+            if (!meas.pending || !agc_enabled[channel] || meas.time_ns < agc_valid_ns[channel]) {
+                continue;
+            }
+
+            float error = meas.power_dbfs - agc_target;
+            if (meas.clipped) {
+                error = std::max(error, SOAPY_RFNM_AGC_CLIP_STEP_DB);
+            } else if (std::abs(error) <= agc_hysteresis) {
+                continue;
+            }
+
+            lock.unlock();
+            {
+                std::lock_guard<std::mutex> config_lock(config_mutex);
+                struct rfnm_api_rx_ch& ch = lrfnm->s->rx.ch[channel];
+                int gain = std::clamp<int>(std::lround(ch.gain - error), ch.gain_range.min, ch.gain_range.max);
+
+                if (gain != ch.gain) {
+                    spdlog::debug("agc: channel {} at {:.1f} dBFS, gain {} -> {} dB", channel, meas.power_dbfs,
+                            static_cast<int>(ch.gain), gain);
+                    ch.gain = gain;
+                    try {
+                        applyRFNM(librfnm_rx_chan_apply[channel]);
+                    } catch (const std::runtime_error& e) {
+                        std::lock_guard<std::mutex> status_lock(status_mutex);
+                        apply_status = e.what();
+                    }
+                }
+            }
+            lock.lock();
+        }
+    }
 }
 
 bool SoapyRFNM::hasDCOffsetMode(const int direction, const size_t channel) const {
@@ -637,25 +3117,359 @@ bool SoapyRFNM::getDCOffsetMode(const int direction, const size_t channel) const
     }
 }
 
-void SoapyRFNM::setRFNM(uint16_t applies) {
+void SoapyRFNM::configure(size_t channel, std::function<void(struct rfnm_api_rx_ch&)> change) {
+    long long time_ns;
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        time_ns = command_time;
+
+        if (!time_ns && defer_apply) {
+            // staged outside lrfnm->s, so applies by the hop, AGC, timed or stream_enable paths
+            // can't send it before the commit
+            deferred_changes.push_back({channel, std::move(change)});
+            deferred_applies |= librfnm_rx_chan_apply[channel];
+            return;
+        }
+
+        if (!time_ns && apply_running) {
+            // the apply thread merges it into lrfnm->s once no transaction is in progress
+            queued_changes.push_back({channel, std::move(change)});
+            apply_cv.notify_one();
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(config_mutex);
+
+    if (time_ns) {
+        struct rfnm_soapy_timed_cmd cmd = {time_ns, channel, std::move(change)};
+        auto pos = std::upper_bound(timed_commands.begin(), timed_commands.end(), cmd.time_ns,
+                [](long long t, const struct rfnm_soapy_timed_cmd& c) { return t < c.time_ns; });
+        timed_commands.insert(pos, std::move(cmd));
+
+        if (!timed_thread.joinable()) {
+            timed_stop = false;
+            timed_thread = std::thread(&SoapyRFNM::timedLoop, this);
+        }
+        timed_cv.notify_all();
+        return;
+    }
+
+    change(lrfnm->s->rx.ch[channel]);
+    applyRFNM(librfnm_rx_chan_apply[channel]);
+}
+
+void SoapyRFNM::mergeDeferred() {
+    // callers hold config_mutex
+    std::lock_guard<std::mutex> lock(staging_mutex);
+    for (auto& deferred : deferred_changes) {
+        deferred.change(lrfnm->s->rx.ch[deferred.channel]);
+    }
+    deferred_changes.clear();
+
+    pending_applies |= deferred_applies;
+    deferred_applies = 0;
+}
+
+struct rfnm_api_rx_ch SoapyRFNM::stagedChannel(size_t channel) const {
+    std::lock_guard<std::mutex> lock(config_mutex);
+    std::lock_guard<std::mutex> staging_lock(staging_mutex);
+
+    // what the channel will look like once the queued and deferred changes are sent
+    struct rfnm_api_rx_ch ch = lrfnm->s->rx.ch[channel];
+    for (const auto* changes : {&queued_changes, &deferred_changes}) {
+        for (auto& staged : *changes) {
+            if (staged.channel == channel) {
+                staged.change(ch);
+            }
+        }
+    }
+    return ch;
+}
+
+void SoapyRFNM::stopTimedCommands() {
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        timed_stop = true;
+    }
+    timed_cv.notify_all();
+
+    if (timed_thread.joinable()) {
+        timed_thread.join();
+    }
+}
+
+void SoapyRFNM::timedLoop() {
+    std::unique_lock<std::mutex> lock(config_mutex);
+
+    while (!timed_stop) {
+        if (timed_commands.empty()) {
+            timed_cv.wait(lock);
+            continue;
+        }
+
+        // start early by the typical apply duration so the change lands on time
+        long long time_ns = timed_commands.front().time_ns;
+        long long start_ns = time_ns - apply_latency_ns;
+        if (nowNs() < start_ns) {
+            timed_cv.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(start_ns)));
+            continue;
+        }
+
+        // commands scheduled for the same time go out together
+        uint16_t applies = 0;
+        while (!timed_commands.empty() && timed_commands.front().time_ns == time_ns) {
+            struct rfnm_soapy_timed_cmd& cmd = timed_commands.front();
+            cmd.change(lrfnm->s->rx.ch[cmd.channel]);
+            applies |= librfnm_rx_chan_apply[cmd.channel];
+            timed_commands.pop_front();
+        }
+
+        // setRFNM marks where the change landed in the stream and posts the status event.
+        // config_mutex stays held so setters can't touch lrfnm->s while it is being sent.
+        long long t0 = nowNs();
+        try {
+            setRFNM(applies);
+        } catch (const std::runtime_error& e) {
+            std::lock_guard<std::mutex> status_lock(status_mutex);
+            apply_status = e.what();
+        }
+        long long t1 = nowNs();
+
+        apply_latency_ns = apply_latency_ns ? (apply_latency_ns * 7 + (t1 - t0)) / 8 : (t1 - t0);
+    }
+}
+
+bool SoapyRFNM::hasHardwareTime(const std::string& what) const {
+    return what.empty();
+}
+
+long long SoapyRFNM::getHardwareTime(const std::string& what) const {
+    // readStream timestamps are host monotonic time of capture
+    return nowNs();
+}
+
+void SoapyRFNM::setCommandTime(const long long timeNs, const std::string& what) {
+    std::lock_guard<std::mutex> lock(staging_mutex);
+    command_time = timeNs;
+}
+
+void SoapyRFNM::applyRFNM(uint16_t applies) {
+    // callers hold config_mutex and have already changed lrfnm->s
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        if (apply_running) {
+            // the apply thread picks this up together with anything else still queued
+            queued_applies |= applies;
+            apply_cv.notify_one();
+            return;
+        }
+    }
+
+    applies |= pending_applies;
+    pending_applies = 0;
+    setRFNM(applies);
+}
+
+void SoapyRFNM::commitRFNM() {
+    // committed changes are handed over like any other, even while defer_apply stays on
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        if (apply_running) {
+            std::move(deferred_changes.begin(), deferred_changes.end(), std::back_inserter(queued_changes));
+            deferred_changes.clear();
+            queued_applies |= deferred_applies;
+            deferred_applies = 0;
+            apply_cv.notify_one();
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(config_mutex);
+    mergeDeferred();
+    if (pending_applies) {
+        uint16_t applies = pending_applies;
+        pending_applies = 0;
+        setRFNM(applies);
+    }
+}
+
+void SoapyRFNM::startApplying() {
+    std::lock_guard<std::mutex> thread_lock(apply_thread_mutex);
+
+    if (apply_thread.joinable()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(staging_mutex);
+    apply_stop = false;
+    apply_running = true;
+    apply_thread = std::thread(&SoapyRFNM::applyLoop, this);
+}
+
+void SoapyRFNM::stopApplying() {
+    std::lock_guard<std::mutex> thread_lock(apply_thread_mutex);
+
+    // the thread drains what is queued and then hands the setters back to the synchronous path,
+    // so nothing queued can land after a later synchronous change
+    {
+        std::lock_guard<std::mutex> lock(staging_mutex);
+        apply_stop = true;
+    }
+    apply_cv.notify_all();
+
+    if (apply_thread.joinable()) {
+        apply_thread.join();
+    }
+}
+
+void SoapyRFNM::applyLoop() {
+    std::unique_lock<std::mutex> lock(staging_mutex);
+
+    while (true) {
+        apply_cv.wait(lock, [this] { return apply_stop || !queued_changes.empty() || queued_applies; });
+
+        if (queued_changes.empty() && !queued_applies) {
+            apply_running = false;
+            break;
+        }
+
+        // every change queued since the last apply goes out in one transaction. Setters only
+        // take staging_mutex, so they keep queueing while config_mutex is held for the transfer.
+        std::vector<struct rfnm_soapy_deferred_change> changes = std::move(queued_changes);
+        queued_changes.clear();
+        uint16_t applies = queued_applies;
+        queued_applies = 0;
+        lock.unlock();
+
+        {
+            std::lock_guard<std::mutex> config_lock(config_mutex);
+            for (auto& queued : changes) {
+                queued.change(lrfnm->s->rx.ch[queued.channel]);
+                applies |= librfnm_rx_chan_apply[queued.channel];
+            }
+            applies |= pending_applies;
+            pending_applies = 0;
+
+            // setRFNM posts the status event, only the error text is kept here
+            try {
+                setRFNM(applies);
+            } catch (const std::runtime_error& e) {
+                std::lock_guard<std::mutex> status_lock(status_mutex);
+                apply_status = e.what();
+            }
+        }
+
+        lock.lock();
+    }
+}
+
+void SoapyRFNM::postStatus(struct rfnm_soapy_status_event ev) {
+    {
+        std::lock_guard<std::mutex> lock(status_mutex);
+        if (!ev.ret) {
+            apply_status = "ok";
+        }
+        if (status_events.size() >= 64) {
+            status_events.pop_front();
+        }
+        status_events.push_back(ev);
+    }
+    status_cv.notify_all();
+}
+
+void SoapyRFNM::setRFNM(uint16_t applies, std::optional<size_t> hop) {
+    // callers hold config_mutex, which keeps lrfnm->s stable for the whole transaction
+    std::lock_guard<std::mutex> apply_lock(apply_mutex);
+
+    // drop channels whose settings match what the hardware already has
+    if (shadow_cache) {
+        for (size_t i = 0; i < rx_chan_count; i++) {
+            if ((applies & librfnm_rx_chan_apply[i]) && rx_shadow_valid[i] &&
+                    !std::memcmp(&rx_shadow[i], &lrfnm->s->rx.ch[i], sizeof(rx_shadow[i]))) {
+                applies &= ~librfnm_rx_chan_apply[i];
+                applies_avoided++;
+            }
+        }
+
+        if (!applies) {
+            return;
+        }
+    }
+
+    // what this transaction sends, recorded as the shadow once the hardware accepted it
+    struct rfnm_api_rx_ch sent[MAX_RX_CHAN_COUNT];
+    std::memcpy(sent, lrfnm->s->rx.ch, sizeof(sent));
+
+    long long start_ns = nowNs();
     rfnm_api_failcode ret = lrfnm->set(applies);
+    long long done_ns = nowNs();
 
-    size_t chan_idx;
-    switch (applies) {
-    case LIBRFNM_APPLY_CH0_RX:
-        chan_idx = 0;
-        break;
-    case LIBRFNM_APPLY_CH1_RX:
-        chan_idx = 1;
-        break;
-    case LIBRFNM_APPLY_CH2_RX:
-        chan_idx = 2;
-        break;
-    case LIBRFNM_APPLY_CH3_RX:
-        chan_idx = 3;
-        break;
-    default:
-        chan_idx = 0;
+    for (size_t i = 0; i < rx_chan_count; i++) {
+        if (applies & librfnm_rx_chan_apply[i]) {
+            rx_shadow[i] = sent[i];
+            rx_shadow_valid[i] = (ret == RFNM_API_OK);
+
+            // readStream switches to the cached DC offsets for the new settings on its next buffer
+            if (ret == RFNM_API_OK) {
+                seedDcOffset(i, sent[i]);
+            }
+
+            // a new sample rate changes the buffer period, the clock starts over on the next buffer
+            bool rate_changed = false;
+            if (ret == RFNM_API_OK) {
+                std::lock_guard<std::mutex> lock(rx_clock_mutex);
+                rate_changed = rx_clock[i].div_n != sent[i].samp_freq_div_n;
+            }
+            if (rate_changed) {
+                resetClock(i);
+            }
+        }
+    }
+
+    // Mark where the change hit each streaming channel, so readStream can drop what was captured
+    // while it settled and start the next read on the first valid sample. Sweeps settle on their own.
+    if (!sweep) {
+        auto settle = hop ? hop_settle : settle_time;
+        long long valid_ns = done_ns + std::chrono::duration_cast<std::chrono::nanoseconds>(settle).count();
+        struct rfnm_soapy_status_event ev = {};
+
+        for (size_t i = 0; i < rx_chan_count; i++) {
+            if (!(applies & librfnm_rx_chan_apply[i])) {
+                continue;
+            }
+            ev.chan_mask |= size_t(1) << i;
+
+            if (stream_active && lrfnm->s->rx.ch[i].enable == RFNM_CH_ON && (hop || settle_mode != RFNM_SOAPY_SETTLE_OFF)) {
+                uint64_t valid = sampleAtTime(i, valid_ns);
+                uint64_t start = (hop || settle_mode == RFNM_SOAPY_SETTLE_DISCARD) ? sampleAtTime(i, start_ns) : valid;
+                pushRxEvent(i, {hop.has_value(), hop.value_or(0), start, valid});
+            }
+        }
+
+        // the AGC ignores levels measured before its change settled
+        {
+            std::lock_guard<std::mutex> lock(agc_mutex);
+            for (size_t i = 0; i < rx_chan_count; i++) {
+                if (applies & librfnm_rx_chan_apply[i]) {
+                    agc_valid_ns[i] = valid_ns;
+                }
+            }
+        }
+
+        ev.ret = (ret == RFNM_API_OK) ? 0 : SOAPY_SDR_STREAM_ERROR;
+        ev.flags = SOAPY_SDR_HAS_TIME;
+        ev.timeNs = valid_ns;
+        postStatus(ev);
+    }
+
+    // batched applies report the lowest channel in the mask
+    size_t chan_idx = 0;
+    for (size_t i = 0; i < MAX_RX_CHAN_COUNT; i++) {
+        if (applies & librfnm_rx_chan_apply[i]) {
+            chan_idx = i;
+            break;
+        }
     }
 
     // GCC cannot pass references to values in packed structs, so we need stack copies
@@ -686,13 +3500,140 @@ void SoapyRFNM::setRFNM(uint16_t applies) {
 SoapySDR::Device* rfnm_device_create(const SoapySDR::Kwargs& args) {
     spdlog::info("rfnm_device_create()");
 
+    // serial=A,B opens the units together as one device
+    if (args.count("serial") != 0) {
+        std::vector<std::string> serials = rfnm_split_serials(args.at("serial"));
+        if (serials.size() > 1) {
+            return new SoapyRFNMMulti(args, serials);
+        }
+    }
+
     return new SoapyRFNM(args);
 }
 
+// Devices found by the last bus scan, shared by every enumeration in the process
+struct rfnm_soapy_find_cache {
+    std::mutex mutex;
+    std::vector<struct rfnm_dev_hwinfo> hwlist;
+    bool valid = false;
+    std::chrono::steady_clock::time_point found;
+    bool hotplug = false;       // invalidated by hotplug events rather than by age
+#ifdef SOAPY_RFNM_HOTPLUG
+    bool hotplug_tried = false;
+    libusb_context* ctx = nullptr;
+    libusb_hotplug_callback_handle handle = 0;
+    std::thread thread;
+    std::atomic<bool> stop = false;
+
+    ~rfnm_soapy_find_cache() {
+        if (!hotplug) {
+            return;
+        }
+        stop = true;
+        libusb_hotplug_deregister_callback(ctx, handle);
+        thread.join();
+        libusb_exit(ctx);
+    }
+#endif
+};
+
+static struct rfnm_soapy_find_cache find_cache;
+
+#ifdef SOAPY_RFNM_HOTPLUG
+static int LIBUSB_CALL hotplugCallback(libusb_context* ctx, libusb_device* device, libusb_hotplug_event event,
+        void* user_data) {
+    auto* cache = static_cast<struct rfnm_soapy_find_cache*>(user_data);
+
+    // an enumeration in progress finishes first, the next one scans again
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->valid = false;
+    return 0;
+}
+
+static void startHotplug(struct rfnm_soapy_find_cache& cache) {
+    // callers hold cache.mutex
+    if (cache.hotplug_tried) {
+        return;
+    }
+    cache.hotplug_tried = true;
+
+    // a private context, so librfnm's own libusb use is left alone
+    if (libusb_init(&cache.ctx) < 0) {
+        return;
+    }
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        spdlog::info("no USB hotplug support, enumeration results expire instead");
+        libusb_exit(cache.ctx);
+        return;
+    }
+
+    int vid = LIBUSB_HOTPLUG_MATCH_ANY;
+    int pid = LIBUSB_HOTPLUG_MATCH_ANY;
+#if defined(RFNM_USB_VID) && defined(RFNM_USB_PID)
+    vid = RFNM_USB_VID;
+    pid = RFNM_USB_PID;
+#endif
+
+    int ret = libusb_hotplug_register_callback(cache.ctx,
+            static_cast<libusb_hotplug_event>(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+            LIBUSB_HOTPLUG_NO_FLAGS, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, hotplugCallback, &cache, &cache.handle);
+    if (ret != LIBUSB_SUCCESS) {
+        spdlog::info("USB hotplug registration failed: {}", libusb_error_name(ret));
+        libusb_exit(cache.ctx);
+        return;
+    }
+
+    cache.thread = std::thread([&cache] {
+        while (!cache.stop) {
+            struct timeval tv = {0, 100000};
+            libusb_handle_events_timeout_completed(cache.ctx, &tv, nullptr);
+        }
+    });
+    cache.hotplug = true;
+}
+#endif
+
 SoapySDR::KwargsList rfnm_device_find(const SoapySDR::Kwargs& args) {
-    std::vector<struct rfnm_dev_hwinfo> hwlist = librfnm::find(LIBRFNM_TRANSPORT_USB);
+    std::vector<struct rfnm_dev_hwinfo> hwlist;
     std::vector< SoapySDR::Kwargs> ret;
 
+    {
+        std::lock_guard<std::mutex> lock(find_cache.mutex);
+#ifdef SOAPY_RFNM_HOTPLUG
+        startHotplug(find_cache);
+#endif
+
+        auto now = std::chrono::steady_clock::now();
+        if (!find_cache.valid || (!find_cache.hotplug && now - find_cache.found > SOAPY_RFNM_FIND_CACHE_TTL)) {
+            find_cache.hwlist = librfnm::find(LIBRFNM_TRANSPORT_USB);
+            find_cache.found = now;
+            find_cache.valid = true;
+        }
+        hwlist = find_cache.hwlist;
+    }
+
+    // an aggregate is only offered when every unit in it is present
+    if (args.count("serial") != 0) {
+        std::vector<std::string> serials = rfnm_split_serials(args.at("serial"));
+        if (serials.size() > 1) {
+            for (const auto& serial : serials) {
+                if (std::none_of(hwlist.begin(), hwlist.end(), [&serial](const struct rfnm_dev_hwinfo& hw) {
+                        return serial == reinterpret_cast<const char*>(hw.motherboard.serial_number);
+                    })) {
+                    return ret;
+                }
+            }
+
+            SoapySDR::Kwargs deviceInfo;
+            deviceInfo["device_id"] = "RFNM";
+            deviceInfo["label"] = "RFNM x" + std::to_string(serials.size()) + " (" + args.at("serial") + ")";
+            deviceInfo["serial"] = args.at("serial");
+            ret.push_back(deviceInfo);
+            return ret;
+        }
+    }
+
     for (auto& hw : hwlist)
     {
         SoapySDR::Kwargs deviceInfo;
@@ -715,6 +3656,11 @@ SoapySDR::KwargsList rfnm_device_find(const SoapySDR::Kwargs& args) {
         std::string serial = reinterpret_cast<char*>(hw.motherboard.serial_number);
         deviceInfo["serial"] = serial;
 
+        // make() enumerates with the serial it was given, only that device is of interest
+        if (args.count("serial") != 0 && args.at("serial") != serial) {
+            continue;
+        }
+
         ret.push_back(deviceInfo);
     }
 
@@ -1,9 +1,20 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <complex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
 #include <string>
+#include <vector>
 
 //#include <libusb-1.0/libusb.h>
 
@@ -15,12 +26,68 @@
 
 
 #define SOAPY_RFNM_BUFCNT LIBRFNM_MIN_RX_BUFCNT
+#define SOAPY_RFNM_MAX_BUFCNT (4 * LIBRFNM_MIN_RX_BUFCNT)
+#define SOAPY_RFNM_MTU_BUFS 16
 #define MAX_RX_CHAN_COUNT 4
 
 struct rfnm_soapy_partial_buf {
     uint8_t* buf;
+    uint32_t size;      // grows when readStream hands samples back
     uint32_t left;
     uint32_t offset;
+    uint64_t sample;
+};
+
+// Maps usb_cc to sample indices and host capture time
+struct rfnm_soapy_cc_clock {
+    bool valid;
+    uint64_t cc;        // last usb_cc seen, extended to 64 bits
+    size_t elems;       // samples per buffer
+    double period_ns;   // duration of one buffer
+    uint8_t div_n;      // sample rate divider period_ns was worked out for
+    double origin_ns;   // estimated capture time of usb_cc 0
+};
+
+enum rfnm_soapy_dc_estimator {
+    RFNM_SOAPY_DC_PERIODIC,
+    RFNM_SOAPY_DC_STREAMING,
+};
+
+enum rfnm_soapy_settle_mode {
+    RFNM_SOAPY_SETTLE_DISCARD,
+    RFNM_SOAPY_SETTLE_TAG,
+    RFNM_SOAPY_SETTLE_OFF,
+};
+
+struct rfnm_soapy_status_event {
+    int ret;
+    size_t chan_mask;
+    int flags;
+    long long timeNs;
+};
+
+struct rfnm_soapy_timed_cmd {
+    long long time_ns;
+    size_t channel;
+    std::function<void(struct rfnm_api_rx_ch&)> change;
+};
+
+struct rfnm_soapy_deferred_change {
+    size_t channel;
+    std::function<void(struct rfnm_api_rx_ch&)> change;
+};
+
+struct rfnm_soapy_hop {
+    double freq;
+    std::chrono::microseconds dwell;
+};
+
+// A point in the sample stream where new settings took effect
+struct rfnm_soapy_rx_event {
+    bool hop;
+    size_t index;       // hop table entry
+    uint64_t start;     // first sample that may be disturbed by the apply
+    uint64_t valid;     // first sample after the settings settled
 };
 
 union rfnm_quad_dc_offset {
@@ -29,6 +96,83 @@ union rfnm_quad_dc_offset {
     float f32[8];
 };
 
+// Transfer sizing and thread placement, given at open time and overridden per stream
+struct rfnm_soapy_stream_args {
+    size_t rx_bufcnt = SOAPY_RFNM_BUFCNT;       // buffers queued to librfnm
+    size_t mtu_bufs = SOAPY_RFNM_MTU_BUFS;      // readStream MTU in buffers
+    std::string rx_cpus;
+    int rx_priority = 0;
+    std::string read_cpus;
+    int numa_node = -1;
+};
+
+// A stream handed out by setupStream
+struct rfnm_soapy_stream {
+    std::vector<size_t> channels;
+    bool active = false;
+    bool async_warmup = false;
+    std::thread::id reader;     // last thread that called readStream
+    struct rfnm_soapy_stream_args args;
+};
+
+// Level statistics gathered while copying samples out to the caller, normalised to full scale
+struct rfnm_soapy_rx_stats {
+    double power = 0.0;     // sum of I^2 and Q^2
+    float peak = 0.0f;      // largest |I| or |Q|
+    uint64_t values = 0;    // I and Q values seen
+    uint64_t clipped = 0;   // values at full scale
+};
+
+// Level handed from readStream to the AGC thread
+struct rfnm_soapy_agc_meas {
+    bool pending = false;
+    float power_dbfs = 0.0f;
+    bool clipped = false;
+    long long time_ns = 0;      // first sample the level was measured on
+};
+
+// Blind IQ imbalance estimate, second order moments of the DC corrected input
+struct rfnm_soapy_iq_balance {
+    bool valid = false;
+    float ii = 0.0f;
+    float qq = 0.0f;
+    float iq = 0.0f;
+    float c_i = 0.0f;
+    float c_q = 1.0f;
+};
+
+struct rfnm_soapy_sweep {
+    size_t channel;
+    std::vector<double> centers;
+    size_t fft_size;
+    size_t averages;
+    size_t bins_per_step;
+    size_t settle_elems;
+    std::vector<float> window;
+    float window_power;
+    std::vector<std::complex<float>> twiddles;
+    std::vector<std::complex<float>> fft_buf;
+    std::vector<float> psd;
+    std::vector<std::complex<float>> capture;
+    size_t captured;
+    size_t settle_left;
+    size_t step;
+    std::vector<float> pending;  // spectrum of the sweep in progress
+    std::vector<float> output;   // last complete sweep
+    size_t output_offset;
+    std::future<void> retune;
+};
+
+struct rfnm_soapy_dc_key {
+    int64_t band;       // LO frequency / SOAPY_RFNM_DC_CACHE_BAND_HZ
+    int8_t gain;
+    enum rfnm_rf_path path;
+    uint8_t div_n;
+    enum librfnm_stream_format format;
+
+    auto operator<=>(const rfnm_soapy_dc_key&) const = default;
+};
+
 class SoapyRFNM : public SoapySDR::Device {
 public:
     explicit SoapyRFNM(const SoapySDR::Kwargs& args);
@@ -57,8 +201,13 @@ public:
     int readStream(SoapySDR::Stream* stream, void* const* buffs, const size_t numElems, int& flags,
         long long& timeNs, const long timeoutUs) override;
 
+    int readStreamStatus(SoapySDR::Stream* stream, size_t& chanMask, int& flags, long long& timeNs,
+        const long timeoutUs) override;
+
     size_t getStreamMTU(SoapySDR::Stream* stream) const override;
 
+    SoapySDR::ArgInfoList getStreamArgsInfo(const int direction, const size_t channel) const override;
+
     size_t getNumChannels(const int direction) const override;
 
     std::string getNativeStreamFormat(const int direction, const size_t channel, double& fullScale) const override;
@@ -93,26 +242,254 @@ public:
     std::string getAntenna(const int direction, const size_t channel) const override;
     void setAntenna(const int direction, const size_t channel, const std::string& name) override;
 
+    // Time API
+    bool hasHardwareTime(const std::string& what) const override;
+    long long getHardwareTime(const std::string& what) const override;
+    void setCommandTime(const long long timeNs, const std::string& what) override;
+
+    // Sensor API
+    std::vector<std::string> listSensors() const override;
+    SoapySDR::ArgInfo getSensorInfo(const std::string& key) const override;
+    std::string readSensor(const std::string& key) const override;
+
+    std::vector<std::string> listSensors(const int direction, const size_t channel) const override;
+    SoapySDR::ArgInfo getSensorInfo(const int direction, const size_t channel, const std::string& key) const override;
+    std::string readSensor(const int direction, const size_t channel, const std::string& key) const override;
+
+    // Settings API
+    SoapySDR::ArgInfoList getSettingInfo() const override;
+    void writeSetting(const std::string& key, const std::string& value) override;
+    std::string readSetting(const std::string& key) const override;
+    SoapySDR::ArgInfoList getSettingInfo(const int direction, const size_t channel) const override;
+    void writeSetting(const int direction, const size_t channel, const std::string& key,
+        const std::string& value) override;
+    std::string readSetting(const int direction, const size_t channel, const std::string& key) const override;
+
     // DC Offset API
     bool hasDCOffsetMode(const int direction, const size_t channel) const override;
     void setDCOffsetMode(const int direction, const size_t channel, const bool automatic) override;
     bool getDCOffsetMode(const int direction, const size_t channel) const override;
 
+    // Gain Mode API
+    bool hasGainMode(const int direction, const size_t channel) const override;
+    void setGainMode(const int direction, const size_t channel, const bool automatic) override;
+    bool getGainMode(const int direction, const size_t channel) const override;
+
+    // IQ Balance API
+    bool hasIQBalanceMode(const int direction, const size_t channel) const override;
+    void setIQBalanceMode(const int direction, const size_t channel, const bool automatic) override;
+    bool getIQBalanceMode(const int direction, const size_t channel) const override;
+
 private:
-    void setRFNM(uint16_t applies);
+    void setRFNM(uint16_t applies, std::optional<size_t> hop = std::nullopt);
+
+    void warmUpChannel(size_t channel);
+    void pauseStream();
+    void endStream(struct rfnm_soapy_stream& st);
+    void stopChannels(const std::vector<size_t>& channels);
+    void startChannel(size_t channel);
+    void stopSession();
+
+    static void parseThreadArgs(const SoapySDR::Kwargs& args, struct rfnm_soapy_stream_args& out);
+    static void parseTransferArgs(const SoapySDR::Kwargs& args, struct rfnm_soapy_stream_args& out);
+    void startRxThreads(enum librfnm_stream_format format);
+    void placeRxThreads();
+    void pinReader(const struct rfnm_soapy_stream& st);
+    int dequeue(size_t channel, struct librfnm_rx_buf** lrxbuf, int64_t wait_us);
+    uint8_t* allocBuffer(size_t size);
+    void measDcOffset(size_t channel, uint8_t* buf, float filter_coeff);
+    void syncDcEstimate(size_t channel);
+    void trackDcOffset(size_t channel, uint8_t* buf, float filter_coeff);
+    void applyDcIqBalance(size_t channel, uint8_t* buf, float dc_track_coeff);
+    void applyDcOffset(size_t channel, uint8_t* buf);
+    void seedDcOffset(size_t channel, const struct rfnm_api_rx_ch& ch);
+    void takeDcSeed(size_t channel);
+    void loadDcCache();
+    void saveDcCache();
+    void applyRFNM(uint16_t applies);
+    void configure(size_t channel, std::function<void(struct rfnm_api_rx_ch&)> change);
+    void mergeDeferred();
+    struct rfnm_api_rx_ch stagedChannel(size_t channel) const;
+
+    void stopTimedCommands();
+    void timedLoop();
+    void commitRFNM();
+
+    void startApplying();
+    void stopApplying();
+    void applyLoop();
+    void postStatus(struct rfnm_soapy_status_event ev);
+
+    std::unique_ptr<struct rfnm_soapy_sweep> setupSweep(size_t channel, const SoapySDR::Kwargs& args);
+    void tuneSweep(size_t step);
+    int readSweep(void* const* buffs, const size_t numElems, int& flags, const long timeoutUs);
+
+    size_t readChannel(size_t channel, uint8_t* dst, const size_t numElems, int& flags, long long& timeNs,
+        struct rfnm_soapy_rx_stats& stats, std::chrono::system_clock::time_point timeout, const long timeoutUs);
+    void unreadChannel(size_t channel, const uint8_t* src, size_t elems);
+    void publishStats(size_t channel, const struct rfnm_soapy_rx_stats& stats, long long time_ns);
+
+    void resetClock(size_t channel);
+    uint64_t observeClock(size_t channel, uint32_t usb_cc);
+    uint64_t sampleAtTime(size_t channel, long long ns) const;
+    long long timeAtSample(size_t channel, uint64_t sample) const;
+
+    void pushRxEvent(size_t channel, struct rfnm_soapy_rx_event ev);
+
+    void startHopping();
+    void stopHopping();
+    void hopLoop();
+
+    void startAgc();
+    void stopAgc();
+    void agcLoop();
 
     size_t rx_chan_count = 0;
     bool dc_correction[MAX_RX_CHAN_COUNT] = {false};
     union rfnm_quad_dc_offset dc_offsets[MAX_RX_CHAN_COUNT] = {};
+    bool dc_init_pending[MAX_RX_CHAN_COUNT] = {};
+    size_t dc_updates[MAX_RX_CHAN_COUNT] = {};
+
+    std::atomic<enum rfnm_soapy_dc_estimator> dc_estimator = RFNM_SOAPY_DC_PERIODIC;
+    std::atomic<uint32_t> dc_update_interval = 16;
+    std::atomic<float> dc_time_constant = 160.0f;
+    float dc_estimate[MAX_RX_CHAN_COUNT][8] = {};
+    bool dc_estimate_valid[MAX_RX_CHAN_COUNT] = {};
+
+    bool iq_correction[MAX_RX_CHAN_COUNT] = {};
+    struct rfnm_soapy_iq_balance iq_balance[MAX_RX_CHAN_COUNT] = {};
+
+    // converged DC offsets per settings, persisted to dc_cache_path
+    std::string dc_cache_path;
+    std::map<struct rfnm_soapy_dc_key, union rfnm_quad_dc_offset> dc_cache;
+    struct rfnm_soapy_dc_key dc_key[MAX_RX_CHAN_COUNT] = {};
+    struct rfnm_soapy_dc_key dc_seed_key[MAX_RX_CHAN_COUNT] = {};
+    std::atomic<bool> dc_seed_pending[MAX_RX_CHAN_COUNT] = {};
+    std::mutex dc_mutex;
 
     librfnm* lrfnm;
 
-    bool stream_setup = false;
+    // streams share the librfnm session, each owns its own channels
+    std::vector<std::unique_ptr<struct rfnm_soapy_stream>> streams;
+    std::mutex stream_mutex;
+    std::atomic<bool> stream_active = false;
+    bool stream_paused = false;
+
+    // receive path left running by closeStream for a quick restart
+    std::atomic<bool> fast_restart = false;
+    bool session_warm = false;
+    bool warm_channels[MAX_RX_CHAN_COUNT] = {};
+    long long restart_ns[MAX_RX_CHAN_COUNT] = {};
+
+    // coalesced wake-ups in readStream, bounded by this latency
+    std::chrono::microseconds batch_latency[MAX_RX_CHAN_COUNT] = {};
+
+    // spinning dequeue ahead of the blocking one, and what it cost
+    std::chrono::microseconds busy_poll[MAX_RX_CHAN_COUNT] = {};
+    std::atomic<uint64_t> poll_spin_ns[MAX_RX_CHAN_COUNT] = {};
+    std::atomic<uint64_t> poll_hits[MAX_RX_CHAN_COUNT] = {};
+    std::atomic<long long> poll_since_ns[MAX_RX_CHAN_COUNT] = {};
+
+    // stream args not given to setupStream fall back to these
+    struct rfnm_soapy_stream_args device_args;
+    // receive thread placement and buffer pool of the running session
+    struct rfnm_soapy_stream_args session_args;
+    std::vector<int> rx_tids;   // librfnm receive threads of the running session, Linux only
+
+    // finite acquisition requested through activateStream
+    bool burst_active[MAX_RX_CHAN_COUNT] = {};
+    size_t burst_left[MAX_RX_CHAN_COUNT] = {};
+    long long burst_start_ns[MAX_RX_CHAN_COUNT] = {};
+    bool burst_start_pending[MAX_RX_CHAN_COUNT] = {};
+    bool stream_channels[MAX_RX_CHAN_COUNT] = {};
+    // set up in a stream but switched off through stream_enable
+    std::atomic<bool> channel_standby[MAX_RX_CHAN_COUNT] = {};
+    enum librfnm_stream_format stream_format = LIBRFNM_STREAM_FORMAT_CS16;
     int outbufsize = 0;
     //int inbufsize = 0;
 
-    struct librfnm_rx_buf rxbuf[SOAPY_RFNM_BUFCNT] = {};
+    // buffers queued to librfnm so far, the count only grows
+    size_t rx_bufs_alloced = 0;
+
+    struct librfnm_rx_buf rxbuf[SOAPY_RFNM_MAX_BUFCNT] = {};
     //struct librfnm_tx_buf txbuf[SOAPY_RFNM_BUFCNT];
 
     struct rfnm_soapy_partial_buf partial_rx_buf[MAX_RX_CHAN_COUNT] = {};
+
+    std::unique_ptr<struct rfnm_soapy_sweep> sweep;
+
+    // serialises lrfnm->s updates between the app, hop and apply threads, and is held across
+    // every hardware transaction so librfnm never sends a half-written channel
+    mutable std::mutex config_mutex;
+    // held for the duration of a hardware transaction
+    std::mutex apply_mutex;
+
+    enum rfnm_soapy_settle_mode settle_mode = RFNM_SOAPY_SETTLE_DISCARD;
+    std::chrono::microseconds settle_time{100};
+
+    uint16_t pending_applies = 0;       // committed, not yet sent
+
+    // setter changes not yet in lrfnm->s, taken after config_mutex so setters never wait on a transaction
+    mutable std::mutex staging_mutex;
+    bool defer_apply = false;
+    std::vector<struct rfnm_soapy_deferred_change> deferred_changes;
+    uint16_t deferred_applies = 0;      // held back until commit
+    std::vector<struct rfnm_soapy_deferred_change> queued_changes;  // for the apply thread to merge
+    uint16_t queued_applies = 0;        // already in lrfnm->s, for the apply thread to send
+
+    std::thread apply_thread;
+    std::mutex apply_thread_mutex;      // serialises starting and stopping the apply thread
+    std::condition_variable apply_cv;
+    bool apply_running = false;
+    bool apply_stop = false;
+
+    // setters after setCommandTime() are queued until the stream reaches that time
+    long long command_time = 0;         // guarded by staging_mutex
+    std::deque<struct rfnm_soapy_timed_cmd> timed_commands;
+    std::thread timed_thread;
+    std::condition_variable timed_cv;
+    bool timed_stop = false;
+    long long apply_latency_ns = 0;
+
+    std::deque<struct rfnm_soapy_status_event> status_events;
+    std::string apply_status = "ok";
+    mutable std::mutex status_mutex;
+    std::condition_variable status_cv;
+
+    // last per-channel state the hardware accepted
+    bool shadow_cache = true;
+    struct rfnm_api_rx_ch rx_shadow[MAX_RX_CHAN_COUNT] = {};
+    bool rx_shadow_valid[MAX_RX_CHAN_COUNT] = {};
+    std::atomic<uint64_t> applies_avoided = 0;
+
+    struct rfnm_soapy_cc_clock rx_clock[MAX_RX_CHAN_COUNT] = {};
+    mutable std::mutex rx_clock_mutex;
+
+    std::deque<struct rfnm_soapy_rx_event> rx_events[MAX_RX_CHAN_COUNT];
+    uint64_t rx_discard_until[MAX_RX_CHAN_COUNT] = {};
+    size_t hop_index[MAX_RX_CHAN_COUNT] = {};
+    mutable std::mutex rx_event_mutex;
+
+    // levels of the last readStream, clip counts since setupStream
+    struct rfnm_soapy_rx_stats rx_stats[MAX_RX_CHAN_COUNT] = {};
+    uint64_t rx_clipped[MAX_RX_CHAN_COUNT] = {};
+    mutable std::mutex stats_mutex;
+
+    std::vector<struct rfnm_soapy_hop> hop_table;
+    std::chrono::microseconds hop_settle{100};
+    std::thread hop_thread;
+    mutable std::mutex hop_mutex;
+    std::condition_variable hop_cv;
+    bool hop_stop = false;
+
+    // automatic gain control, fed by readStream and applied from its own thread
+    std::atomic<bool> agc_enabled[MAX_RX_CHAN_COUNT] = {};
+    struct rfnm_soapy_agc_meas agc_meas[MAX_RX_CHAN_COUNT] = {};
+    long long agc_valid_ns[MAX_RX_CHAN_COUNT] = {};
+    std::atomic<float> agc_target = -20.0f;
+    std::atomic<float> agc_hysteresis = 3.0f;
+    std::thread agc_thread;
+    std::condition_variable agc_cv;
+    bool agc_stop = false;
+    std::mutex agc_mutex;
 };
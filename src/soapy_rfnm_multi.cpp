@@ -0,0 +1,737 @@
+#include <spdlog/spdlog.h>
+
+#include <SoapySDR/Formats.hpp>
+
+#include "soapy_rfnm_multi.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <sstream>
+
+std::vector<std::string> rfnm_split_serials(const std::string& serials) {
+    std::vector<std::string> ret;
+    std::istringstream fields(serials);
+    std::string serial;
+
+    while (std::getline(fields, serial, ',')) {
+        if (!serial.empty()) {
+            ret.push_back(serial);
+        }
+    }
+
+    return ret;
+}
+
+static std::string joinSerials(const std::vector<std::string>& values) {
+    std::string ret;
+
+    for (const auto& value : values) {
+        if (!ret.empty()) {
+            ret += ",";
+        }
+        ret += value;
+    }
+
+    return ret;
+}
+
+SoapyRFNMMulti::SoapyRFNMMulti(const SoapySDR::Kwargs& args, const std::vector<std::string>& serials)
+        : serials(serials) {
+    spdlog::info("RFNMDevice::RFNMDevice() aggregating {} units", serials.size());
+
+    // the units come up in parallel, each open is independent of the others
+    std::vector<std::future<std::unique_ptr<SoapyRFNM>>> opens;
+    for (const auto& serial : serials) {
+        SoapySDR::Kwargs unit_args = args;
+        unit_args["serial"] = serial;
+        if (args.count("dc_cache") != 0) {
+            unit_args["dc_cache"] = args.at("dc_cache") + "." + serial;
+        }
+
+        opens.push_back(std::async(std::launch::async, [unit_args] {
+            return std::make_unique<SoapyRFNM>(unit_args);
+        }));
+    }
+
+    // wait for every open before rethrowing, so the units that did come up are closed again
+    std::exception_ptr error;
+    for (auto& open : opens) {
+        try {
+            units.push_back(open.get());
+        } catch (...) {
+            error = std::current_exception();
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    size_t base = 0;
+    for (const auto& unit : units) {
+        chan_base.push_back(base);
+        base += unit->getNumChannels(SOAPY_SDR_RX);
+    }
+}
+
+SoapyRFNMMulti::~SoapyRFNMMulti() {
+    while (!streams.empty()) {
+        closeStream(reinterpret_cast<SoapySDR::Stream*>(streams.back().get()));
+    }
+}
+
+std::pair<SoapyRFNM*, size_t> SoapyRFNMMulti::unitChannel(const int direction, const size_t channel) const {
+    if (direction != SOAPY_SDR_RX) {
+        return {units[0].get(), channel};
+    }
+
+    for (size_t u = 0; u < units.size(); u++) {
+        if (channel >= chan_base[u] && channel < chan_base[u] + units[u]->getNumChannels(SOAPY_SDR_RX)) {
+            return {units[u].get(), channel - chan_base[u]};
+        }
+    }
+
+    throw std::runtime_error("nonexistent channel");
+}
+
+std::string SoapyRFNMMulti::getDriverKey() const {
+    return units[0]->getDriverKey();
+}
+
+std::string SoapyRFNMMulti::getHardwareKey() const {
+    return units[0]->getHardwareKey();
+}
+
+SoapySDR::Kwargs SoapyRFNMMulti::getHardwareInfo() const {
+    SoapySDR::Kwargs info = units[0]->getHardwareInfo();
+    info["serial"] = joinSerials(serials);
+    info["units"] = std::to_string(units.size());
+    return info;
+}
+
+SoapySDR::Stream* SoapyRFNMMulti::setupStream(const int direction, const std::string& format,
+        const std::vector<size_t>& channels, const SoapySDR::Kwargs& args) {
+    if (direction != SOAPY_SDR_RX) {
+        return nullptr;
+    }
+
+    if (args.count("sweep_start") != 0) {
+        throw std::runtime_error("sweep streams are not supported across units");
+    }
+
+    auto ms = std::make_unique<struct rfnm_soapy_multi_stream>();
+
+    if (!format.compare(SOAPY_SDR_CF32)) {
+        ms->bytes_per_ele = 8;
+    } else if (!format.compare(SOAPY_SDR_CS16)) {
+        ms->bytes_per_ele = 4;
+    } else if (!format.compare(SOAPY_SDR_CS8)) {
+        ms->bytes_per_ele = 2;
+    } else {
+        throw std::runtime_error("setupStream invalid format " + format);
+    }
+
+    // split the logical channels by unit, remembering where each lands in the caller's buffers
+    std::vector<std::vector<size_t>> local(units.size());
+    std::vector<std::vector<size_t>> slots(units.size());
+    for (size_t i = 0; i < channels.size(); i++) {
+        auto [unit, channel] = unitChannel(direction, channels[i]);
+        size_t u = std::find_if(units.begin(), units.end(),
+                [unit](const std::unique_ptr<SoapyRFNM>& other) { return other.get() == unit; }) - units.begin();
+        local[u].push_back(channel);
+        slots[u].push_back(i);
+    }
+
+    for (size_t u = 0; u < units.size(); u++) {
+        if (local[u].empty()) {
+            continue;
+        }
+
+        struct rfnm_soapy_multi_unit unit;
+        unit.unit = u;
+        try {
+            unit.stream = units[u]->setupStream(direction, format, local[u], args);
+        } catch (...) {
+            for (auto& other : ms->units) {
+                units[other.unit]->closeStream(other.stream);
+            }
+            throw;
+        }
+        unit.channels = local[u];
+        unit.slots = slots[u];
+        unit.backlog.resize(local[u].size());
+        ms->units.push_back(std::move(unit));
+    }
+
+    for (size_t i = 0; i < ms->units.size(); i++) {
+        ms->workers.emplace_back(&SoapyRFNMMulti::workerLoop, this, ms.get(), i);
+    }
+
+    streams.push_back(std::move(ms));
+    return reinterpret_cast<SoapySDR::Stream*>(streams.back().get());
+}
+
+void SoapyRFNMMulti::closeStream(SoapySDR::Stream* stream) {
+    auto* ms = reinterpret_cast<struct rfnm_soapy_multi_stream*>(stream);
+
+    {
+        std::lock_guard<std::mutex> lock(ms->mutex);
+        ms->stop = true;
+    }
+    ms->work_cv.notify_all();
+    for (auto& worker : ms->workers) {
+        worker.join();
+    }
+
+    for (auto& unit : ms->units) {
+        units[unit.unit]->closeStream(unit.stream);
+    }
+
+    std::erase_if(streams, [ms](const std::unique_ptr<struct rfnm_soapy_multi_stream>& other) {
+        return other.get() == ms;
+    });
+}
+
+int SoapyRFNMMulti::activateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs,
+        const size_t numElems) {
+    auto* ms = reinterpret_cast<struct rfnm_soapy_multi_stream*>(stream);
+
+    if (ms->units.empty()) {
+        return 0;
+    }
+
+    // samples are matched up by capture time, which needs one sample period across all units
+    double rate = 0.0;
+    for (auto& unit : ms->units) {
+        for (size_t channel : unit.channels) {
+            double chan_rate = units[unit.unit]->getSampleRate(SOAPY_SDR_RX, channel);
+            if (rate && chan_rate != rate) {
+                throw std::runtime_error("aggregated channels must run at the same sample rate");
+            }
+            rate = chan_rate;
+        }
+    }
+    ms->period_ns = 1e9 / rate;
+
+    // usb_cc places buffers to within one buffer period, a larger jump means samples were lost
+    size_t mtu = getStreamMTU(stream);
+    ms->tolerance_ns = mtu * ms->period_ns / 2;
+
+    for (auto& unit : ms->units) {
+        unit.backlog_elems = 0;
+        unit.boundaries.clear();
+        unit.burst_read = 0;
+        unit.finished = false;
+        for (auto& backlog : unit.backlog) {
+            backlog.resize(2 * mtu * ms->bytes_per_ele);
+        }
+    }
+    ms->aligned = false;
+    ms->burst_elems = (flags & SOAPY_SDR_END_BURST) ? numElems : 0;
+
+    // the warm-up of each unit takes a while, overlap them
+    std::vector<std::future<int>> activations;
+    for (auto& unit : ms->units) {
+        activations.push_back(std::async(std::launch::async, [this, &unit, flags, timeNs, numElems] {
+            return units[unit.unit]->activateStream(unit.stream, flags, timeNs, numElems);
+        }));
+    }
+
+    int ret = 0;
+    for (auto& activation : activations) {
+        int unit_ret = activation.get();
+        if (unit_ret) {
+            ret = unit_ret;
+        }
+    }
+
+    return ret;
+}
+
+int SoapyRFNMMulti::deactivateStream(SoapySDR::Stream* stream, const int flags0, const long long timeNs) {
+    auto* ms = reinterpret_cast<struct rfnm_soapy_multi_stream*>(stream);
+    int ret = 0;
+
+    for (auto& unit : ms->units) {
+        int unit_ret = units[unit.unit]->deactivateStream(unit.stream, flags0, timeNs);
+        if (unit_ret) {
+            ret = unit_ret;
+        }
+    }
+
+    return ret;
+}
+
+void SoapyRFNMMulti::workerLoop(struct rfnm_soapy_multi_stream* ms, size_t index) {
+    struct rfnm_soapy_multi_unit& unit = ms->units[index];
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(ms->mutex);
+
+    while (true) {
+        ms->work_cv.wait(lock, [ms, seen] { return ms->stop || ms->generation != seen; });
+        if (ms->stop) {
+            break;
+        }
+        seen = ms->generation;
+
+        size_t want = unit.want;
+        long timeout_us = ms->timeout_us;
+        std::vector<void*> buffs;
+        for (auto& backlog : unit.backlog) {
+            buffs.push_back(backlog.data() + unit.backlog_elems * ms->bytes_per_ele);
+        }
+        lock.unlock();
+
+        int flags = 0;
+        long long time_ns = 0;
+        int ret = 0;
+        if (want) {
+            ret = units[unit.unit]->readStream(unit.stream, buffs.data(), want, flags, time_ns, timeout_us);
+        }
+
+        lock.lock();
+        unit.ret = ret;
+        unit.flags = flags;
+        unit.time_ns = time_ns;
+        if (--ms->busy == 0) {
+            ms->done_cv.notify_all();
+        }
+    }
+}
+
+int SoapyRFNMMulti::fillBacklogs(struct rfnm_soapy_multi_stream* ms, size_t numElems, long timeoutUs) {
+    std::unique_lock<std::mutex> lock(ms->mutex);
+
+    for (auto& unit : ms->units) {
+        unit.want = numElems > unit.backlog_elems ? numElems - unit.backlog_elems : 0;
+        for (auto& backlog : unit.backlog) {
+            if (backlog.size() < (unit.backlog_elems + unit.want) * ms->bytes_per_ele) {
+                backlog.resize((unit.backlog_elems + unit.want) * ms->bytes_per_ele);
+            }
+        }
+    }
+
+    // every unit reads at the same time, each into the tail of its own backlog
+    ms->timeout_us = timeoutUs;
+    ms->busy = ms->units.size();
+    ms->generation++;
+    ms->work_cv.notify_all();
+    ms->done_cv.wait(lock, [ms] { return ms->busy == 0; });
+
+    for (auto& unit : ms->units) {
+        if (unit.ret == SOAPY_SDR_TIMEOUT || !unit.want) {
+            continue;
+        }
+        if (unit.ret < 0) {
+            ms->aligned = false;
+            return unit.ret;
+        }
+        if (!unit.ret) {
+            continue;
+        }
+
+        long long time_ns = unit.time_ns;
+        if (!(unit.flags & SOAPY_SDR_HAS_TIME)) {
+            time_ns = unit.head_ns + static_cast<long long>(unit.backlog_elems * ms->period_ns);
+        }
+
+        if (!unit.backlog_elems) {
+            unit.head_ns = time_ns;
+        } else {
+            long long expected = unit.head_ns + static_cast<long long>(unit.backlog_elems * ms->period_ns);
+            if (std::abs(time_ns - expected) > ms->tolerance_ns) {
+                // lost samples on this unit, what is queued no longer lines up with the others
+                spdlog::info("unit {} jumped by {} ns, realigning", unit.unit, time_ns - expected);
+                for (auto& backlog : unit.backlog) {
+                    std::memmove(backlog.data(), backlog.data() + unit.backlog_elems * ms->bytes_per_ele,
+                            unit.ret * ms->bytes_per_ele);
+                }
+                unit.backlog_elems = 0;
+                unit.boundaries.clear();
+                unit.head_ns = time_ns;
+                ms->aligned = false;
+            }
+        }
+        unit.backlog_elems += unit.ret;
+
+        // hop, settle and burst ends of the unit, readStream stops the aggregate read there
+        if (unit.flags & SOAPY_SDR_END_BURST) {
+            unit.boundaries.push_back(unit.backlog_elems);
+        }
+        if (ms->burst_elems) {
+            unit.burst_read += unit.ret;
+            unit.finished = unit.burst_read >= ms->burst_elems;
+        }
+    }
+
+    return 0;
+}
+
+static void dropBacklog(struct rfnm_soapy_multi_unit& unit, size_t elems, size_t bytes_per_ele, double period_ns) {
+    elems = std::min(elems, unit.backlog_elems);
+    for (auto& backlog : unit.backlog) {
+        std::memmove(backlog.data(), backlog.data() + elems * bytes_per_ele,
+                (unit.backlog_elems - elems) * bytes_per_ele);
+    }
+    unit.backlog_elems -= elems;
+    unit.head_ns += static_cast<long long>(elems * period_ns);
+
+    for (auto& boundary : unit.boundaries) {
+        boundary = boundary > elems ? boundary - elems : 0;
+    }
+    while (!unit.boundaries.empty() && !unit.boundaries.front()) {
+        unit.boundaries.pop_front();
+    }
+}
+
+int SoapyRFNMMulti::readStream(SoapySDR::Stream* stream, void* const* buffs, const size_t numElems, int& flags,
+        long long int& timeNs, const long timeoutUs) {
+    auto* ms = reinterpret_cast<struct rfnm_soapy_multi_stream*>(stream);
+    auto timeout = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+    if (ms->units.empty()) {
+        return 0;
+    }
+
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(timeout - std::chrono::steady_clock::now());
+        int ret = fillBacklogs(ms, numElems, std::max<long>(0, remaining.count()));
+        if (ret < 0) {
+            return ret;
+        }
+
+        bool empty = std::any_of(ms->units.begin(), ms->units.end(),
+                [](const struct rfnm_soapy_multi_unit& unit) { return !unit.backlog_elems; });
+
+        // a unit that delivered its whole burst gets no more samples, the aggregate burst is over
+        bool over = std::any_of(ms->units.begin(), ms->units.end(),
+                [](const struct rfnm_soapy_multi_unit& unit) { return unit.finished && !unit.backlog_elems; });
+        if (over) {
+            return 0;
+        }
+
+        // drop the head of every unit that started earlier than the latest one
+        if (!ms->aligned && !empty) {
+            long long start_ns = std::max_element(ms->units.begin(), ms->units.end(),
+                    [](const struct rfnm_soapy_multi_unit& a, const struct rfnm_soapy_multi_unit& b) {
+                        return a.head_ns < b.head_ns;
+                    })->head_ns;
+
+            ms->aligned = true;
+            for (auto& unit : ms->units) {
+                size_t drop = std::llround((start_ns - unit.head_ns) / ms->period_ns);
+                dropBacklog(unit, drop, ms->bytes_per_ele, ms->period_ns);
+                if (!unit.backlog_elems) {
+                    ms->aligned = false;
+                }
+            }
+        }
+
+        if (ms->aligned && !empty) {
+            break;
+        }
+
+        if (std::chrono::steady_clock::now() >= timeout) {
+            return SOAPY_SDR_TIMEOUT;
+        }
+    }
+
+    size_t count = numElems;
+    for (auto& unit : ms->units) {
+        count = std::min(count, unit.backlog_elems);
+    }
+
+    // the first boundary of any unit ends the read for all of them
+    bool end = false;
+    for (auto& unit : ms->units) {
+        if (!unit.boundaries.empty() && unit.boundaries.front() <= count) {
+            count = unit.boundaries.front();
+            end = true;
+        }
+    }
+
+    flags = SOAPY_SDR_HAS_TIME | (end ? SOAPY_SDR_END_BURST : 0);
+    timeNs = ms->units[0].head_ns;
+
+    for (auto& unit : ms->units) {
+        for (size_t c = 0; c < unit.backlog.size(); c++) {
+            std::memcpy(buffs[unit.slots[c]], unit.backlog[c].data(), count * ms->bytes_per_ele);
+        }
+        dropBacklog(unit, count, ms->bytes_per_ele, ms->period_ns);
+    }
+
+    return count;
+}
+
+int SoapyRFNMMulti::readStreamStatus(SoapySDR::Stream* stream, size_t& chanMask, int& flags, long long& timeNs,
+        const long timeoutUs) {
+    auto* ms = reinterpret_cast<struct rfnm_soapy_multi_stream*>(stream);
+    auto timeout = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+    do {
+        for (auto& unit : ms->units) {
+            size_t unit_mask = 0;
+            int ret = units[unit.unit]->readStreamStatus(unit.stream, unit_mask, flags, timeNs, 0);
+            if (ret != SOAPY_SDR_TIMEOUT) {
+                chanMask = unit_mask << chan_base[unit.unit];
+                return ret;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    } while (std::chrono::steady_clock::now() < timeout);
+
+    return SOAPY_SDR_TIMEOUT;
+}
+
+size_t SoapyRFNMMulti::getStreamMTU(SoapySDR::Stream* stream) const {
+    auto* ms = reinterpret_cast<struct rfnm_soapy_multi_stream*>(stream);
+    size_t mtu = 0;
+
+    for (auto& unit : ms->units) {
+        size_t unit_mtu = units[unit.unit]->getStreamMTU(unit.stream);
+        mtu = mtu ? std::min(mtu, unit_mtu) : unit_mtu;
+    }
+
+    return mtu;
+}
+
+SoapySDR::ArgInfoList SoapyRFNMMulti::getStreamArgsInfo(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getStreamArgsInfo(direction, unit_channel);
+}
+
+size_t SoapyRFNMMulti::getNumChannels(const int direction) const {
+    size_t count = 0;
+
+    for (const auto& unit : units) {
+        count += unit->getNumChannels(direction);
+    }
+
+    return count;
+}
+
+std::string SoapyRFNMMulti::getNativeStreamFormat(const int direction, const size_t channel, double& fullScale) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getNativeStreamFormat(direction, unit_channel, fullScale);
+}
+
+std::vector<std::string> SoapyRFNMMulti::getStreamFormats(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getStreamFormats(direction, unit_channel);
+}
+
+std::vector<double> SoapyRFNMMulti::listSampleRates(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->listSampleRates(direction, unit_channel);
+}
+
+double SoapyRFNMMulti::getSampleRate(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getSampleRate(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::setSampleRate(const int direction, const size_t channel, const double rate) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setSampleRate(direction, unit_channel, rate);
+}
+
+std::vector<std::string> SoapyRFNMMulti::listFrequencies(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->listFrequencies(direction, unit_channel);
+}
+
+SoapySDR::RangeList SoapyRFNMMulti::getFrequencyRange(const int direction, const size_t channel,
+        const std::string &name) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getFrequencyRange(direction, unit_channel, name);
+}
+
+double SoapyRFNMMulti::getFrequency(const int direction, const size_t channel, const std::string &name) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getFrequency(direction, unit_channel, name);
+}
+
+void SoapyRFNMMulti::setFrequency(const int direction, const size_t channel, const std::string &name,
+        const double frequency, const SoapySDR::Kwargs& args) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setFrequency(direction, unit_channel, name, frequency, args);
+}
+
+std::vector<std::string> SoapyRFNMMulti::listGains(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->listGains(direction, unit_channel);
+}
+
+SoapySDR::Range SoapyRFNMMulti::getGainRange(const int direction, const size_t channel, const std::string &name) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getGainRange(direction, unit_channel, name);
+}
+
+double SoapyRFNMMulti::getGain(const int direction, const size_t channel, const std::string &name) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getGain(direction, unit_channel, name);
+}
+
+void SoapyRFNMMulti::setGain(const int direction, const size_t channel, const std::string &name, const double value) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setGain(direction, unit_channel, name, value);
+}
+
+SoapySDR::RangeList SoapyRFNMMulti::getBandwidthRange(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getBandwidthRange(direction, unit_channel);
+}
+
+double SoapyRFNMMulti::getBandwidth(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getBandwidth(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::setBandwidth(const int direction, const size_t channel, const double bw) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setBandwidth(direction, unit_channel, bw);
+}
+
+std::vector<std::string> SoapyRFNMMulti::listAntennas(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->listAntennas(direction, unit_channel);
+}
+
+std::string SoapyRFNMMulti::getAntenna(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getAntenna(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::setAntenna(const int direction, const size_t channel, const std::string& name) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setAntenna(direction, unit_channel, name);
+}
+
+bool SoapyRFNMMulti::hasHardwareTime(const std::string& what) const {
+    return units[0]->hasHardwareTime(what);
+}
+
+long long SoapyRFNMMulti::getHardwareTime(const std::string& what) const {
+    // every unit timestamps against the same host clock
+    return units[0]->getHardwareTime(what);
+}
+
+void SoapyRFNMMulti::setCommandTime(const long long timeNs, const std::string& what) {
+    for (auto& unit : units) {
+        unit->setCommandTime(timeNs, what);
+    }
+}
+
+std::vector<std::string> SoapyRFNMMulti::listSensors() const {
+    return units[0]->listSensors();
+}
+
+SoapySDR::ArgInfo SoapyRFNMMulti::getSensorInfo(const std::string& key) const {
+    SoapySDR::ArgInfo info = units[0]->getSensorInfo(key);
+    info.description += " (one value per unit, in serial order)";
+    info.type = SoapySDR::ArgInfo::STRING;
+    return info;
+}
+
+std::string SoapyRFNMMulti::readSensor(const std::string& key) const {
+    std::vector<std::string> values;
+
+    for (const auto& unit : units) {
+        values.push_back(unit->readSensor(key));
+    }
+
+    return joinSerials(values);
+}
+
+std::vector<std::string> SoapyRFNMMulti::listSensors(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->listSensors(direction, unit_channel);
+}
+
+SoapySDR::ArgInfo SoapyRFNMMulti::getSensorInfo(const int direction, const size_t channel,
+        const std::string& key) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getSensorInfo(direction, unit_channel, key);
+}
+
+std::string SoapyRFNMMulti::readSensor(const int direction, const size_t channel, const std::string& key) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->readSensor(direction, unit_channel, key);
+}
+
+SoapySDR::ArgInfoList SoapyRFNMMulti::getSettingInfo() const {
+    return units[0]->getSettingInfo();
+}
+
+void SoapyRFNMMulti::writeSetting(const std::string& key, const std::string& value) {
+    // device settings apply to every unit alike
+    for (auto& unit : units) {
+        unit->writeSetting(key, value);
+    }
+}
+
+std::string SoapyRFNMMulti::readSetting(const std::string& key) const {
+    return units[0]->readSetting(key);
+}
+
+SoapySDR::ArgInfoList SoapyRFNMMulti::getSettingInfo(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getSettingInfo(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::writeSetting(const int direction, const size_t channel, const std::string& key,
+        const std::string& value) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->writeSetting(direction, unit_channel, key, value);
+}
+
+std::string SoapyRFNMMulti::readSetting(const int direction, const size_t channel, const std::string& key) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->readSetting(direction, unit_channel, key);
+}
+
+bool SoapyRFNMMulti::hasDCOffsetMode(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->hasDCOffsetMode(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::setDCOffsetMode(const int direction, const size_t channel, const bool automatic) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setDCOffsetMode(direction, unit_channel, automatic);
+}
+
+bool SoapyRFNMMulti::getDCOffsetMode(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getDCOffsetMode(direction, unit_channel);
+}
+
+bool SoapyRFNMMulti::hasGainMode(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->hasGainMode(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::setGainMode(const int direction, const size_t channel, const bool automatic) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setGainMode(direction, unit_channel, automatic);
+}
+
+bool SoapyRFNMMulti::getGainMode(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getGainMode(direction, unit_channel);
+}
+
+bool SoapyRFNMMulti::hasIQBalanceMode(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->hasIQBalanceMode(direction, unit_channel);
+}
+
+void SoapyRFNMMulti::setIQBalanceMode(const int direction, const size_t channel, const bool automatic) {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    unit->setIQBalanceMode(direction, unit_channel, automatic);
+}
+
+bool SoapyRFNMMulti::getIQBalanceMode(const int direction, const size_t channel) const {
+    auto [unit, unit_channel] = unitChannel(direction, channel);
+    return unit->getIQBalanceMode(direction, unit_channel);
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "soapy_rfnm.h"
+
+// Samples of one unit waiting to be matched up with the other units
+struct rfnm_soapy_multi_unit {
+    size_t unit;
+    SoapySDR::Stream* stream;
+    std::vector<size_t> channels;               // unit channel numbers
+    std::vector<size_t> slots;                  // caller buffer index of each unit channel
+    std::vector<std::vector<uint8_t>> backlog;  // per unit channel
+    size_t backlog_elems = 0;
+    long long head_ns = 0;                      // capture time of the first backlog sample
+    std::deque<size_t> boundaries;              // backlog lengths at which a unit read ended a burst
+    size_t burst_read = 0;
+    bool finished = false;                      // the unit delivered its whole finite burst
+
+    // read handed to the unit's worker
+    size_t want = 0;
+    int ret = 0;
+    int flags = 0;
+    long long time_ns = 0;
+};
+
+struct rfnm_soapy_multi_stream {
+    std::vector<struct rfnm_soapy_multi_unit> units;
+    size_t bytes_per_ele;
+    double period_ns = 0.0;
+    double tolerance_ns = 0.0;
+    bool aligned = false;
+    size_t burst_elems = 0;                     // finite burst length per channel, 0 streams on
+
+    // one worker per unit, so the units are read in parallel
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    uint64_t generation = 0;
+    size_t busy = 0;
+    long timeout_us = 0;
+    bool stop = false;
+};
+
+std::vector<std::string> rfnm_split_serials(const std::string& serials);
+
+// Several RFNM units presented as one device, their channels concatenated in serial order
+class SoapyRFNMMulti : public SoapySDR::Device {
+public:
+    SoapyRFNMMulti(const SoapySDR::Kwargs& args, const std::vector<std::string>& serials);
+
+    ~SoapyRFNMMulti();
+
+    [[nodiscard]] std::string getDriverKey() const override;
+
+    [[nodiscard]] std::string getHardwareKey() const override;
+
+    [[nodiscard]] SoapySDR::Kwargs getHardwareInfo() const override;
+
+    // Stream API
+    SoapySDR::Stream* setupStream(const int direction,
+        const std::string& format,
+        const std::vector<size_t>& channels = std::vector<size_t>(),
+        const SoapySDR::Kwargs& args = SoapySDR::Kwargs()) override;
+
+    void closeStream(SoapySDR::Stream* stream) override;
+
+    int activateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs,
+        const size_t numElems) override;
+
+    int deactivateStream(SoapySDR::Stream* stream, const int flags0, const long long timeNs) override;
+
+    int readStream(SoapySDR::Stream* stream, void* const* buffs, const size_t numElems, int& flags,
+        long long& timeNs, const long timeoutUs) override;
+
+    int readStreamStatus(SoapySDR::Stream* stream, size_t& chanMask, int& flags, long long& timeNs,
+        const long timeoutUs) override;
+
+    size_t getStreamMTU(SoapySDR::Stream* stream) const override;
+
+    SoapySDR::ArgInfoList getStreamArgsInfo(const int direction, const size_t channel) const override;
+
+    size_t getNumChannels(const int direction) const override;
+
+    std::string getNativeStreamFormat(const int direction, const size_t channel, double& fullScale) const override;
+
+    std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const override;
+
+    // Sample Rate API
+    std::vector<double> listSampleRates(const int direction, const size_t channel) const override;
+    double getSampleRate(const int direction, const size_t channel) const override;
+    void setSampleRate(const int direction, const size_t channel, const double rate) override;
+
+    // Frequency API
+    std::vector<std::string> listFrequencies(const int direction, const size_t channel) const override;
+    SoapySDR::RangeList getFrequencyRange(const int direction, const size_t channel, const std::string &name) const override;
+    double getFrequency(const int direction, const size_t channel, const std::string &name) const override;
+    void setFrequency(const int direction, const size_t channel, const std::string &name, const double frequency,
+            const SoapySDR::Kwargs& args) override;
+
+    // Gain API
+    std::vector<std::string> listGains(const int direction, const size_t channel) const override;
+    SoapySDR::Range getGainRange(const int direction, const size_t channel, const std::string &name) const override;
+    double getGain(const int direction, const size_t channel, const std::string &name) const override;
+    void setGain(const int direction, const size_t channel, const std::string &name, const double value) override;
+
+    // Bandwidth API
+    SoapySDR::RangeList getBandwidthRange(const int direction, const size_t channel) const override;
+    double getBandwidth(const int direction, const size_t channel) const override;
+    void setBandwidth(const int direction, const size_t channel, const double bw) override;
+
+    // Antenna API
+    std::vector<std::string> listAntennas(const int direction, const size_t channel) const override;
+    std::string getAntenna(const int direction, const size_t channel) const override;
+    void setAntenna(const int direction, const size_t channel, const std::string& name) override;
+
+    // Time API
+    bool hasHardwareTime(const std::string& what) const override;
+    long long getHardwareTime(const std::string& what) const override;
+    void setCommandTime(const long long timeNs, const std::string& what) override;
+
+    // Sensor API
+    std::vector<std::string> listSensors() const override;
+    SoapySDR::ArgInfo getSensorInfo(const std::string& key) const override;
+    std::string readSensor(const std::string& key) const override;
+
+    std::vector<std::string> listSensors(const int direction, const size_t channel) const override;
+    SoapySDR::ArgInfo getSensorInfo(const int direction, const size_t channel, const std::string& key) const override;
+    std::string readSensor(const int direction, const size_t channel, const std::string& key) const override;
+
+    // Settings API
+    SoapySDR::ArgInfoList getSettingInfo() const override;
+    void writeSetting(const std::string& key, const std::string& value) override;
+    std::string readSetting(const std::string& key) const override;
+    SoapySDR::ArgInfoList getSettingInfo(const int direction, const size_t channel) const override;
+    void writeSetting(const int direction, const size_t channel, const std::string& key,
+        const std::string& value) override;
+    std::string readSetting(const int direction, const size_t channel, const std::string& key) const override;
+
+    // DC Offset API
+    bool hasDCOffsetMode(const int direction, const size_t channel) const override;
+    void setDCOffsetMode(const int direction, const size_t channel, const bool automatic) override;
+    bool getDCOffsetMode(const int direction, const size_t channel) const override;
+
+    // Gain Mode API
+    bool hasGainMode(const int direction, const size_t channel) const override;
+    void setGainMode(const int direction, const size_t channel, const bool automatic) override;
+    bool getGainMode(const int direction, const size_t channel) const override;
+
+    // IQ Balance API
+    bool hasIQBalanceMode(const int direction, const size_t channel) const override;
+    void setIQBalanceMode(const int direction, const size_t channel, const bool automatic) override;
+    bool getIQBalanceMode(const int direction, const size_t channel) const override;
+
+private:
+    std::pair<SoapyRFNM*, size_t> unitChannel(const int direction, const size_t channel) const;
+
+    void workerLoop(struct rfnm_soapy_multi_stream* ms, size_t index);
+    int fillBacklogs(struct rfnm_soapy_multi_stream* ms, size_t numElems, long timeoutUs);
+
+    std::vector<std::string> serials;
+    std::vector<std::unique_ptr<SoapyRFNM>> units;
+    std::vector<size_t> chan_base;      // first logical channel of each unit
+    std::vector<std::unique_ptr<struct rfnm_soapy_multi_stream>> streams;
+};